@@ -3,23 +3,38 @@
 #include <ctype.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "console.h"
+#include "perf.h"
 #include "report.h"
+#include "trace.h"
 #include "web.h"
 
+/* Need allocation statistics of the tested program */
+#define INTERNAL 1
+#include "harness.h"
+
 /* Some global values */
 int simulation = 0;
 int show_entropy = 0;
 static cmd_element_t *cmd_list = NULL;
 static param_element_t *param_list = NULL;
+
+/* Commands and parameters are also hashed by name for dispatch */
+#define HASH_SIZE 64
+static cmd_element_t *cmd_hash[HASH_SIZE];
+static param_element_t *param_hash[HASH_SIZE];
 static bool block_flag = false;
 static bool prompt_flag = true;
 
@@ -40,6 +55,13 @@ typedef struct __rio {
     int count;             /* Unread bytes in internal buffer */
     char *bufptr;          /* Next unread byte in internal buffer */
     char buf[RIO_BUFSIZE]; /* Internal buffer */
+    const char *map;       /* Whole file when memory-mapped, else NULL */
+    size_t map_len;        /* Size of the mapping */
+    size_t map_pos;        /* Offset of the next line in the mapping */
+    trace_t trace;         /* Compiled trace, base is NULL for text */
+    cmd_element_t **cmds;  /* Command of each name in the trace */
+    char **argv;           /* Arguments of the running trace command */
+    char *args;            /* Strings argv points to */
     struct __rio *prev;    /* Next element in stack */
 } rio_t;
 
@@ -54,6 +76,22 @@ static int err_limit = 5;
 static int err_cnt = 0;
 static int echo = 0;
 
+/* Hardware counters around each command: 0 off, 1 text, 2 CSV records */
+static int perf_mode = 0;
+#define MAXLINE_PERF 256
+
+/* Per-command statistics emitted as JSON lines, NULL when disabled */
+static FILE *statfile = NULL;
+
+/* Number of queue operations performed by the running command */
+static __thread long cmd_ops = 1;
+
+/* Web connection the running command answers, 0 for none */
+__thread int web_connfd;
+
+/* Whether this thread is a worker running web commands */
+static __thread bool on_worker = false;
+
 static bool quit_flag = false;
 static char *prompt = "cmd> ";
 static bool has_infile = false;
@@ -72,6 +110,22 @@ static void pop_file();
 
 static bool interpret_cmda(int argc, char *argv[]);
 
+/* FNV-1a hash of len bytes */
+static unsigned hash_mem(const char *s, size_t len)
+{
+    unsigned h = 2166136261U;
+    while (len--) {
+        h ^= (unsigned char) *s++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static unsigned hash_str(const char *s)
+{
+    return hash_mem(s, strlen(s));
+}
+
 /* Add a new command */
 void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
 {
@@ -87,8 +141,14 @@ void add_cmd(char *name, cmd_func_t operation, char *summary, char *param)
     cmd->operation = operation;
     cmd->summary = summary;
     cmd->param = param;
+    cmd->latency = NULL;
     cmd->next = next_cmd;
     *last_loc = cmd;
+
+    /* A command added again shadows the earlier one */
+    cmd_element_t **bucket = &cmd_hash[hash_str(name) % HASH_SIZE];
+    cmd->hash_next = *bucket;
+    *bucket = cmd;
 }
 
 /* Add a new parameter */
@@ -109,53 +169,86 @@ void add_param(char *name, int *valp, char *summary, setter_func_t setter)
     param->setter = setter;
     param->next = next_param;
     *last_loc = param;
+
+    param_element_t **bucket = &param_hash[hash_str(name) % HASH_SIZE];
+    param->hash_next = *bucket;
+    *bucket = param;
 }
 
-/* Parse a string into a command line */
-static char **parse_args(char *line, int *argcp)
+/* Split line in place into words separated by white space.  Store up to
+ * max of them in argv and return how many there are, which may exceed max.
+ */
+static int split_args(char *line, char *argv[], int max)
 {
-    /* Must first determine how many arguments there are.
-     * Replace all white space with null characters
-     */
-    size_t len = strlen(line);
-
-    /* First copy into buffer with each substring null-terminated */
-    char *buf = malloc_or_fail(len + 1, "parse_args");
-    buf[len] = '\0';
-
-    char *src = line;
-    char *dst = buf;
-    bool skipping = true;
-    int c;
     int argc = 0;
-    while ((c = *src++) != '\0') {
-        if (isspace(c)) {
-            if (!skipping) {
-                /* Hit end of word */
-                *dst++ = '\0';
-                skipping = true;
-            }
-        } else {
-            if (skipping) {
-                /* Hit start of new word */
-                argc++;
-                skipping = false;
-            }
-            *dst++ = c;
-        }
+    char *p = line;
+    for (;;) {
+        while (isspace((unsigned char) *p))
+            p++;
+        if (!*p)
+            break;
+        if (argc < max)
+            argv[argc] = p;
+        argc++;
+        while (*p && !isspace((unsigned char) *p))
+            p++;
+        if (!*p)
+            break;
+        *p++ = '\0';
     }
+    return argc;
+}
 
-    /* Now assemble into array of strings */
-    char **argv = calloc_or_fail(argc, sizeof(char *), "parse_args");
-    src = buf;
-    for (int i = 0; i < argc; i++) {
-        argv[i] = strsave_or_fail(src, "parse_args");
-        src += strlen(argv[i]) + 1;
-    }
+/* Scratch space reused to split command lines without allocating */
+static char *scratch = NULL;
+static size_t scratch_size = 0;
+static char **scratch_argv = NULL;
+static int scratch_max = 0;
+
+/* Make room for max words in scratch_argv */
+static void scratch_reserve(int max)
+{
+    if (max <= scratch_max)
+        return;
+    if (scratch_argv)
+        free_array(scratch_argv, scratch_max, sizeof(char *));
+    scratch_max = max < 16 ? 16 : max;
+    scratch_argv = calloc_or_fail(scratch_max, sizeof(char *), "scratch");
+}
 
-    free_block(buf, len + 1);
+/* Split a copy of the len bytes of line in the scratch space, return its
+ * words
+ */
+static char **parse_args(const char *line, size_t len, int *argcp)
+{
+    if (len >= scratch_size) {
+        if (scratch)
+            free_block(scratch, scratch_size);
+        scratch_size = len < RIO_BUFSIZE ? RIO_BUFSIZE : len + 1;
+        scratch = malloc_or_fail(scratch_size, "parse_args");
+    }
+    memcpy(scratch, line, len);
+    scratch[len] = '\0';
+    int argc = split_args(scratch, scratch_argv, scratch_max);
+    if (argc > scratch_max) {
+        scratch_reserve(argc);
+        memcpy(scratch, line, len);
+        split_args(scratch, scratch_argv, scratch_max);
+    }
     *argcp = argc;
-    return argv;
+    return scratch_argv;
+}
+
+static void free_scratch(void)
+{
+    if (scratch)
+        free_block(scratch, scratch_size);
+    if (scratch_argv)
+        free_array(scratch_argv, scratch_max, sizeof(char *));
+    scratch = NULL;
+    scratch_argv = NULL;
+    scratch_size = 0;
+    scratch_max = 0;
 }
 
 static void record_error()
@@ -167,18 +260,444 @@ static void record_error()
     }
 }
 
-/* Execute a command that has already been split into arguments */
-static bool interpret_cmda(int argc, char *argv[])
+static void perf_setter(int oldval)
+{
+    if (!perf_mode) {
+        perf_close();
+        return;
+    }
+
+    if (!perf_open()) {
+        report(1, "Hardware performance counters are not available");
+        perf_mode = 0;
+        return;
+    }
+
+    if (perf_mode == 2 && oldval != 2) {
+        char buf[MAXLINE_PERF];
+        int len = snprintf(buf, sizeof(buf), "perf,cmd");
+        for (int i = 0; i < N_PERF; i++)
+            len += snprintf(buf + len, sizeof(buf) - len, ",%s", perf_name(i));
+        report(1, "%s", buf);
+    }
+}
+
+/* Report counters accumulated while running command name */
+static void report_perf(const char *name,
+                        const perf_sample_t *before,
+                        const perf_sample_t *after)
+{
+    char buf[MAXLINE_PERF];
+    int len = 0;
+    perf_sample_t d;
+    perf_delta(&d, before, after);
+
+    if (perf_mode == 2) {
+        len += snprintf(buf + len, sizeof(buf) - len, "perf,%.32s", name);
+        for (int i = 0; i < N_PERF; i++) {
+            if (d.valid & (1U << i))
+                len += snprintf(buf + len, sizeof(buf) - len, ",%lu",
+                                (unsigned long) d.val[i]);
+            else
+                len += snprintf(buf + len, sizeof(buf) - len, ",");
+        }
+        report(1, "%s", buf);
+        return;
+    }
+
+    len += snprintf(buf + len, sizeof(buf) - len, "Perf:");
+    for (int i = 0; i < N_PERF; i++) {
+        if (!(d.valid & (1U << i)))
+            continue;
+        len += snprintf(buf + len, sizeof(buf) - len, " %s %lu", perf_name(i),
+                        (unsigned long) d.val[i]);
+        if (i == PERF(instructions) && (d.valid & (1U << PERF(cycles))) &&
+            d.val[PERF(cycles)])
+            len += snprintf(buf + len, sizeof(buf) - len, " (IPC %.2f)",
+                            (double) d.val[i] / d.val[PERF(cycles)]);
+    }
+    report(1, "%s", buf);
+}
+
+/* Measurements taken around a single command */
+typedef struct {
+    bool counted;
+    struct timespec start;
+    alloc_stats_t alloc;
+    perf_sample_t perf;
+    long saved_ops;
+} cmd_stat_t;
+
+void set_cmd_ops(long ops)
+{
+    cmd_ops = ops;
+}
+
+bool set_statfile(char *file_name)
+{
+    if (statfile)
+        fclose(statfile);
+    statfile = fopen(file_name, "w");
+    return statfile != NULL;
+}
+
+/* Write string s as a JSON string literal */
+static void json_string(FILE *f, const char *s)
+{
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+    fputc('"', f);
+}
+
+static histogram_t *cmd_latency(cmd_element_t *cmd)
+{
+    if (!cmd->latency) {
+        cmd->latency = malloc_or_fail(sizeof(histogram_t), "cmd_latency");
+        hist_init(cmd->latency);
+    }
+    return cmd->latency;
+}
+
+static void cmd_stat_begin(cmd_stat_t *st)
+{
+    st->saved_ops = cmd_ops;
+    cmd_ops = 1;
+
+    /* Counters follow the main thread only */
+    st->counted = perf_mode && !on_worker && perf_read(&st->perf);
+    if (statfile) {
+        alloc_stats(&st->alloc);
+        alloc_stats_set_peak(0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &st->start);
+}
+
+static void cmd_stat_end(cmd_stat_t *st,
+                         cmd_element_t *cmd,
+                         int argc,
+                         char *argv[],
+                         bool ok)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long ns = (end.tv_sec - st->start.tv_sec) * 1000000000L +
+              (end.tv_nsec - st->start.tv_nsec);
+
+    hist_record(cmd_latency(cmd), ns);
+
+    perf_sample_t perf, d;
+    bool counted = st->counted && perf_read(&perf);
+    long ops = cmd_ops;
+    cmd_ops = st->saved_ops;
+
+    if (counted && perf_mode)
+        report_perf(argv[0], &st->perf, &perf);
+
+    if (!statfile)
+        return;
+
+    alloc_stats_t alloc;
+    alloc_stats(&alloc);
+    /* Keep the peak seen by an enclosing command, e.g. 'time' */
+    alloc_stats_set_peak(st->alloc.peak_bytes > alloc.peak_bytes
+                             ? st->alloc.peak_bytes
+                             : alloc.peak_bytes);
+
+    fprintf(statfile, "{\"cmd\":");
+    json_string(statfile, argv[0]);
+    fprintf(statfile, ",\"args\":[");
+    for (int i = 1; i < argc; i++) {
+        if (i > 1)
+            fputc(',', statfile);
+        json_string(statfile, argv[i]);
+    }
+    fprintf(statfile,
+            "],\"ok\":%s,\"ns\":%ld,\"ops\":%ld,\"ops_per_sec\":%.1f,"
+            "\"allocs\":%lu,\"frees\":%lu,\"live_blocks\":%lu,"
+            "\"live_bytes\":%lu,\"peak_bytes\":%lu",
+            ok ? "true" : "false", ns, ops, ns > 0 ? ops * 1e9 / ns : 0.0,
+            (unsigned long) (alloc.malloc_cnt - st->alloc.malloc_cnt),
+            (unsigned long) (alloc.free_cnt - st->alloc.free_cnt),
+            (unsigned long) alloc.live_blocks,
+            (unsigned long) alloc.live_bytes,
+            (unsigned long) alloc.peak_bytes);
+    if (counted) {
+        perf_delta(&d, &st->perf, &perf);
+        for (int i = 0; i < N_PERF; i++) {
+            if (d.valid & (1U << i))
+                fprintf(statfile, ",\"%s\":%lu", perf_name(i),
+                        (unsigned long) d.val[i]);
+        }
+    }
+    fprintf(statfile, "}\n");
+    fflush(statfile);
+}
+
+static cmd_element_t *find_cmd(const char *name)
+{
+    cmd_element_t *cmd = cmd_hash[hash_str(name) % HASH_SIZE];
+    while (cmd && strcmp(name, cmd->name) != 0)
+        cmd = cmd->hash_next;
+    return cmd;
+}
+
+static param_element_t *find_param(const char *name)
+{
+    param_element_t *param = param_hash[hash_str(name) % HASH_SIZE];
+    while (param && strcmp(name, param->name) != 0)
+        param = param->hash_next;
+    return param;
+}
+
+/* Web commands run on worker threads when 'option parallel' is set */
+static int parallel = 0;
+static const parallel_ops_t *par_ops = NULL;
+
+#define MAX_WORKERS 64
+
+typedef struct __job {
+    size_t size;
+    int connfd;
+    int argc;
+    char **argv;
+    cmd_element_t *cmd;
+    void *queue;
+    bool ok;
+    struct __job *next;
+} job_t;
+
+static pthread_t workers[MAX_WORKERS];
+static int worker_cnt = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_idle = PTHREAD_COND_INITIALIZER;
+static job_t *job_head = NULL, **job_tail = &job_head;
+static job_t *done_list = NULL;
+static int in_flight = 0;
+static bool pool_exit = false;
+
+/* Written by workers as jobs complete, wakes up the main loop */
+static int done_pipe[2] = {-1, -1};
+
+/* Latency histograms and the statistics file are shared by workers */
+static pthread_mutex_t stat_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void set_parallel_ops(const parallel_ops_t *ops)
+{
+    par_ops = ops;
+}
+
+static void pool_run(job_t *job)
+{
+    web_connfd = job->connfd;
+    par_ops->select(job->queue);
+    par_ops->lock(true);
+
+    cmd_stat_t st;
+    cmd_stat_begin(&st);
+    job->ok = job->cmd->operation(job->argc, job->argv);
+    pthread_mutex_lock(&stat_lock);
+    cmd_stat_end(&st, job->cmd, job->argc, job->argv, job->ok);
+    pthread_mutex_unlock(&stat_lock);
+
+    par_ops->lock(false);
+    web_connfd = 0;
+}
+
+static void *pool_worker(void *arg)
+{
+    /* Time limits rely on SIGALRM, which belongs to the main thread */
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    set_alarm_mode(false);
+    on_worker = true;
+
+    pthread_mutex_lock(&pool_lock);
+    for (;;) {
+        while (!job_head && !pool_exit)
+            pthread_cond_wait(&pool_work, &pool_lock);
+        job_t *job = job_head;
+        if (!job)
+            break;
+        job_head = job->next;
+        if (!job_head)
+            job_tail = &job_head;
+        pthread_mutex_unlock(&pool_lock);
+
+        pool_run(job);
+
+        pthread_mutex_lock(&pool_lock);
+        job->next = done_list;
+        done_list = job;
+        if (--in_flight == 0)
+            pthread_cond_signal(&pool_idle);
+        /* Nonblocking, a full pipe wakes up the main loop all the same */
+        (void) !write(done_pipe[1], "", 1);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return NULL;
+}
+
+/* Complete the requests of finished jobs on the main thread */
+static void pool_reap(void)
+{
+    char buf[64];
+    while (read(done_pipe[0], buf, sizeof(buf)) > 0)
+        ;
+
+    pthread_mutex_lock(&pool_lock);
+    job_t *job = done_list;
+    done_list = NULL;
+    pthread_mutex_unlock(&pool_lock);
+
+    while (job) {
+        job_t *next = job->next;
+        if (!job->ok)
+            record_error();
+        web_done(job->connfd);
+        free_block(job, job->size);
+        job = next;
+    }
+}
+
+/* Wait until every worker is idle */
+static void pool_drain(void)
+{
+    if (!worker_cnt)
+        return;
+    pthread_mutex_lock(&pool_lock);
+    while (in_flight)
+        pthread_cond_wait(&pool_idle, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+    pool_reap();
+}
+
+static void pool_stop(void)
+{
+    if (!worker_cnt)
+        return;
+    pool_drain();
+
+    pthread_mutex_lock(&pool_lock);
+    pool_exit = true;
+    pthread_cond_broadcast(&pool_work);
+    pthread_mutex_unlock(&pool_lock);
+    for (int i = 0; i < worker_cnt; i++)
+        pthread_join(workers[i], NULL);
+    worker_cnt = 0;
+    pool_exit = false;
+    set_threaded_mode(false);
+}
+
+/* Start up to cnt workers, return how many are running */
+static int pool_start(int cnt)
+{
+    if (done_pipe[0] < 0) {
+        if (pipe(done_pipe) < 0)
+            return 0;
+        for (int i = 0; i < 2; i++)
+            fcntl(done_pipe[i], F_SETFL, O_NONBLOCK);
+    }
+
+    set_threaded_mode(true);
+    while (worker_cnt < cnt &&
+           !pthread_create(&workers[worker_cnt], NULL, pool_worker, NULL))
+        worker_cnt++;
+    if (!worker_cnt)
+        set_threaded_mode(false);
+    return worker_cnt;
+}
+
+static void parallel_setter(int oldval)
+{
+    pool_stop();
+    if (parallel <= 0) {
+        parallel = 0;
+        return;
+    }
+    if (!par_ops) {
+        report(1, "Commands cannot run in parallel");
+        parallel = 0;
+        return;
+    }
+    if (parallel > MAX_WORKERS)
+        parallel = MAX_WORKERS;
+    int cnt = pool_start(parallel);
+    if (cnt < parallel)
+        report(1, "Only %d of %d worker threads could be started", cnt,
+               parallel);
+    parallel = cnt;
+}
+
+/* Hand a single queue-local command to the workers.
+ * Return false if it has to run on the main thread instead.
+ */
+static bool pool_dispatch(int connfd, char *line)
+{
+    char *eol = strchr(line, '\n');
+    if (eol && eol[1])
+        return false; /* Lines of a trace depend on each other */
+    if (eol)
+        *eol = '\0';
+
+    int argc;
+    char **argv = parse_args(line, strlen(line), &argc);
+    cmd_element_t *cmd = argc ? find_cmd(argv[0]) : NULL;
+    if (!cmd || !par_ops->concurrent(argc, argv))
+        return false;
+
+    if (echo)
+        report(1, "%s%s", prompt, line);
+    /* Workers must not allocate through the console */
+    cmd_latency(cmd);
+
+    /* The job keeps its own copy of the words along with it */
+    size_t len = strlen(line);
+    size_t size = sizeof(job_t) + argc * sizeof(char *) + len + 1;
+    job_t *job = malloc_or_fail(size, "pool_dispatch");
+    job->size = size;
+    job->connfd = connfd;
+    job->argc = argc;
+    job->argv = (char **) (job + 1);
+    memcpy(job->argv + argc, line, len + 1);
+    split_args((char *) (job->argv + argc), job->argv, argc);
+    job->cmd = cmd;
+    job->queue = web_get_data(connfd);
+    if (!job->queue)
+        job->queue = par_ops->current();
+    web_set_data(connfd, job->queue);
+    job->next = NULL;
+
+    pthread_mutex_lock(&pool_lock);
+    *job_tail = job;
+    job_tail = &job->next;
+    in_flight++;
+    pthread_cond_signal(&pool_work);
+    pthread_mutex_unlock(&pool_lock);
+    return true;
+}
+
+/* Execute command next_cmd, NULL if argv[0] names no command */
+static bool run_cmd(cmd_element_t *next_cmd, int argc, char *argv[])
 {
-    if (argc == 0)
-        return true;
-    /* Try to find matching command */
-    cmd_element_t *next_cmd = cmd_list;
     bool ok = true;
-    while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
-        next_cmd = next_cmd->next;
     if (next_cmd) {
+        cmd_stat_t st;
+        cmd_stat_begin(&st);
         ok = next_cmd->operation(argc, argv);
+        /* 'quit' releases the command list */
+        if (cmd_list)
+            cmd_stat_end(&st, next_cmd, argc, argv, ok);
         if (!ok)
             record_error();
     } else {
@@ -190,22 +709,91 @@ static bool interpret_cmda(int argc, char *argv[])
     return ok;
 }
 
-/* Execute a command from a command line */
-static bool interpret_cmd(char *cmdline)
+/* Execute a command that has already been split into arguments */
+static bool interpret_cmda(int argc, char *argv[])
+{
+    if (argc == 0)
+        return true;
+    return run_cmd(find_cmd(argv[0]), argc, argv);
+}
+
+/* Parsed form of recently interpreted lines.  Traces repeat the same lines
+ * over and over, and those then skip tokenizing.
+ */
+#define CACHE_SIZE 64
+#define CACHE_LINE 128
+#define CACHE_ARGS 8
+
+typedef struct {
+    char line[CACHE_LINE];
+    size_t len;
+    char tokens[CACHE_LINE];
+    char *argv[CACHE_ARGS];
+    int argc;
+    /* Entry is in use by the running command */
+    bool busy;
+} line_cache_t;
+
+static line_cache_t line_cache[CACHE_SIZE];
+
+/* Keep the words of line in entry e.  Return false if they do not fit or
+ * the entry is in use.
+ */
+static bool cache_put(line_cache_t *e,
+                      const char *line,
+                      size_t len,
+                      int argc,
+                      char *argv[])
+{
+    if (len >= CACHE_LINE || !argc || argc > CACHE_ARGS || e->busy)
+        return false;
+
+    memcpy(e->line, line, len);
+    e->len = len;
+    /* Words never take more room than the line they come from */
+    char *dst = e->tokens;
+    for (int i = 0; i < argc; i++) {
+        e->argv[i] = dst;
+        dst = stpcpy(dst, argv[i]) + 1;
+    }
+    e->argc = argc;
+    return true;
+}
+
+/* Execute a command from the len bytes of line, which need not be
+ * terminated
+ */
+static bool interpret_line(const char *line, size_t len)
 {
     if (quit_flag)
         return false;
 
-    int argc;
-    char **argv = parse_args(cmdline, &argc);
-    bool ok = interpret_cmda(argc, argv);
-    for (int i = 0; i < argc; i++)
-        free_string(argv[i]);
-    free_array(argv, argc, sizeof(char *));
+    /* Run every other command once the workers are done */
+    pool_drain();
+
+    line_cache_t *e = &line_cache[hash_mem(line, len) % CACHE_SIZE];
+    bool hit = e->argc && !e->busy && e->len == len &&
+               !memcmp(e->line, line, len);
+    if (!hit) {
+        int argc;
+        char **argv = parse_args(line, len, &argc);
+        if (!cache_put(e, line, len, argc, argv))
+            return interpret_cmda(argc, argv);
+    }
 
+    /* Pin the entry, a nested command must not overwrite it */
+    e->busy = true;
+    bool ok = interpret_cmda(e->argc, e->argv);
+    e->busy = false;
     return ok;
 }
 
+/* Execute a command from a command line */
+static bool interpret_cmd(char *cmdline)
+{
+    return interpret_line(cmdline, strlen(cmdline));
+}
+
 /* Set function to be executed as part of program exit */
 void add_quit_helper(cmd_func_t qf)
 {
@@ -229,8 +817,12 @@ static bool do_quit(int argc, char *argv[])
     while (c) {
         cmd_element_t *ele = c;
         c = c->next;
+        if (ele->latency)
+            free_block(ele->latency, sizeof(histogram_t));
         free_block(ele, sizeof(cmd_element_t));
     }
+    cmd_list = NULL;
+    memset(cmd_hash, 0, sizeof(cmd_hash));
 
     param_element_t *p = param_list;
     while (p) {
@@ -238,13 +830,20 @@ static bool do_quit(int argc, char *argv[])
         p = p->next;
         free_block(ele, sizeof(param_element_t));
     }
+    param_list = NULL;
+    memset(param_hash, 0, sizeof(param_hash));
 
     while (buf_stack)
         pop_file();
 
+    pool_stop();
+    perf_close();
+
     for (int i = 0; i < quit_helper_cnt; i++) {
         ok = ok && quit_helpers[i](argc, argv);
     }
+    /* The words of this very command may live there, release it last */
+    free_scratch();
 
     quit_flag = true;
     return ok;
@@ -311,7 +910,6 @@ static bool do_option(int argc, char *argv[])
     for (int i = 1; i < argc; i++) {
         char *name = argv[i];
         int value = 0;
-        bool found = false;
         /* Get value from next argument */
         if (i + 1 >= argc) {
             report(1, "No value given for parameter %s", name);
@@ -320,23 +918,15 @@ static bool do_option(int argc, char *argv[])
             report(1, "Cannot parse '%s' as integer", argv[i]);
             return false;
         }
-        /* Find parameter in list */
-        param_element_t *plist = param_list;
-        while (!found && plist) {
-            if (strcmp(plist->name, name) == 0) {
-                int oldval = *plist->valp;
-                *plist->valp = value;
-                if (plist->setter)
-                    plist->setter(oldval);
-                found = true;
-            } else
-                plist = plist->next;
-        }
-        /* Didn't find parameter */
-        if (!found) {
+        param_element_t *param = find_param(name);
+        if (!param) {
             report(1, "Unknown parameter '%s'", name);
             return false;
         }
+        int oldval = *param->valp;
+        *param->valp = value;
+        if (param->setter)
+            param->setter(oldval);
     }
 
     return true;
@@ -391,8 +981,49 @@ static bool do_time(int argc, char *argv[])
     return ok;
 }
 
+static void report_latency(cmd_element_t *c)
+{
+    histogram_t *h = c->latency;
+    report(1, "  %-12s%10lu%10lu%10lu%10lu%10lu%10lu%12lu", c->name,
+           (unsigned long) h->total, (unsigned long) h->min,
+           (unsigned long) hist_percentile(h, 50),
+           (unsigned long) hist_percentile(h, 90),
+           (unsigned long) hist_percentile(h, 99),
+           (unsigned long) hist_percentile(h, 99.9), (unsigned long) h->max);
+}
+
+static bool do_stats(int argc, char *argv[])
+{
+    if (argc > 2) {
+        report(1, "%s takes 0-1 arguments", argv[0]);
+        return false;
+    }
+
+    bool reset = argc == 2 && strcmp(argv[1], "reset") == 0;
+    bool found = argc == 1 || reset;
+    if (!reset)
+        report(1, "  %-12s%10s%10s%10s%10s%10s%10s%12s", "Command", "count",
+               "min", "p50", "p90", "p99", "p99.9", "max(ns)");
+
+    for (cmd_element_t *c = cmd_list; c; c = c->next) {
+        if (!c->latency || (argc == 2 && !reset && strcmp(argv[1], c->name)))
+            continue;
+        found = true;
+        if (reset)
+            hist_init(c->latency);
+        else if (c->latency->total)
+            report_latency(c);
+    }
+
+    if (!found) {
+        report(1, "No latency recorded for command '%s'", argv[1]);
+        return false;
+    }
+    return true;
+}
+
 static bool use_linenoise = true;
-static int web_fd;
+static int web_fd = -1;
 
 static bool do_web(int argc, char *argv[])
 {
@@ -418,6 +1049,8 @@ void init_cmd()
 {
     cmd_list = NULL;
     param_list = NULL;
+    memset(cmd_hash, 0, sizeof(cmd_hash));
+    memset(param_hash, 0, sizeof(param_hash));
     err_cnt = 0;
     quit_flag = false;
 
@@ -429,6 +1062,9 @@ void init_cmd()
     ADD_COMMAND(source, "Read commands from source file", "");
     ADD_COMMAND(log, "Copy output to file", "file");
     ADD_COMMAND(time, "Time command execution", "cmd arg ...");
+    ADD_COMMAND(stats,
+                "Show latency percentiles of each command, or reset them",
+                "[cmd|reset]");
     ADD_COMMAND(web, "Read commands from builtin web server", "[port]");
     add_cmd("#", do_comment_cmd, "Display comment", "...");
     add_param("simulation", &simulation, "Start/Stop simulation mode", NULL);
@@ -436,6 +1072,12 @@ void init_cmd()
     add_param("error", &err_limit, "Number of errors until exit", NULL);
     add_param("echo", &echo, "Do/don't echo commands", NULL);
     add_param("entropy", &show_entropy, "Show/Hide Shannon entropy", NULL);
+    add_param("perf", &perf_mode,
+              "Report hardware counters per command (0: off, 1: text, 2: CSV)",
+              perf_setter);
+    add_param("parallel", &parallel,
+              "Worker threads running web commands (0: main thread only)",
+              parallel_setter);
 
     init_in();
     init_time(&last_time);
@@ -460,6 +1102,44 @@ static bool push_file(char *fname)
     rnew->fd = fd;
     rnew->count = 0;
     rnew->bufptr = rnew->buf;
+    rnew->map = NULL;
+    rnew->map_len = rnew->map_pos = 0;
+    rnew->trace.base = NULL;
+    rnew->cmds = NULL;
+    rnew->argv = NULL;
+    rnew->args = NULL;
+
+    /* Commands of a compiled trace are looked up once per name */
+    if (fname && trace_probe(fd)) {
+        if (!trace_open(&rnew->trace, fd)) {
+            report(1, "Invalid compiled trace '%s'", fname);
+            free_block(rnew, sizeof(rio_t));
+            close(fd);
+            return false;
+        }
+        rnew->cmds = calloc_or_fail(rnew->trace.names + 1,
+                                    sizeof(cmd_element_t *), "push_file");
+        for (uint32_t i = 0; i < rnew->trace.names; i++)
+            rnew->cmds[i] = find_cmd(trace_name(&rnew->trace, i));
+        /* Not the scratch array: a nested source must not move it while
+         * the command sourcing it still holds its arguments
+         */
+        rnew->argv = calloc_or_fail(rnew->trace.max_args + 1, sizeof(char *),
+                                    "push_file");
+        rnew->args = malloc_or_fail(rnew->trace.max_bytes + 1, "push_file");
+    } else if (fname) {
+        /* Scan regular files in place, fall back to read() otherwise */
+        struct stat st;
+        if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                madvise(p, st.st_size, MADV_SEQUENTIAL);
+                rnew->map = p;
+                rnew->map_len = st.st_size;
+            }
+        }
+    }
+
     rnew->prev = buf_stack;
     buf_stack = rnew;
 
@@ -472,6 +1152,16 @@ static void pop_file()
     if (buf_stack) {
         rio_t *rsave = buf_stack;
         buf_stack = rsave->prev;
+        if (rsave->trace.base) {
+            free_array(rsave->cmds, rsave->trace.names + 1,
+                       sizeof(cmd_element_t *));
+            free_array(rsave->argv, rsave->trace.max_args + 1,
+                       sizeof(char *));
+            free_block(rsave->args, rsave->trace.max_bytes + 1);
+            trace_close(&rsave->trace);
+        }
+        if (rsave->map)
+            munmap((void *) rsave->map, rsave->map_len);
         close(rsave->fd);
         free_block(rsave, sizeof(rio_t));
     }
@@ -544,6 +1234,119 @@ static bool cmd_done()
     return !buf_stack || quit_flag;
 }
 
+/* Return next line of the memory-mapped file on top of the stack, along
+ * with its length including the newline.  Return NULL at its end.
+ */
+static const char *map_readline(size_t *lenp)
+{
+    rio_t *r = buf_stack;
+    if (r->map_pos >= r->map_len)
+        return NULL;
+
+    const char *line = r->map + r->map_pos;
+    size_t left = r->map_len - r->map_pos;
+    const char *eol = memchr(line, '\n', left);
+    size_t len = eol ? (size_t) (eol - line) + 1 : left;
+    r->map_pos += len;
+
+    if (echo) {
+        report_noreturn(1, prompt);
+        report_noreturn(1, "%.*s%s", (int) len, line, eol ? "" : "\n");
+    }
+    *lenp = len;
+    return line;
+}
+
+/* Run the lines of the mapped file on top of the stack.  With batch set,
+ * keep going until the file ends or another file is sourced.
+ */
+static void map_run(bool batch)
+{
+    rio_t *r = buf_stack;
+    do {
+        size_t len;
+        const char *line = map_readline(&len);
+        if (!line) {
+            pop_file();
+            return;
+        }
+        interpret_line(line, len);
+    } while (batch && !cmd_done() && buf_stack == r);
+}
+
+/* Run commands of the compiled trace on top of the stack.  With batch set,
+ * keep going until the trace ends or another file is sourced.
+ */
+static void trace_run(bool batch)
+{
+    rio_t *r = buf_stack;
+    do {
+        uint32_t id;
+        int argc;
+        if (!trace_next(&r->trace, &id, &argc, r->argv, r->args)) {
+            pop_file();
+            return;
+        }
+        /* Echo the line back, its words joined by single spaces */
+        if (echo) {
+            report_noreturn(1, prompt);
+            for (int i = 0; i < argc; i++)
+                report_noreturn(1, "%s%s", r->argv[i],
+                                i + 1 < argc ? " " : "\n");
+        }
+        pool_drain();
+        run_cmd(r->cmds[id], argc, r->argv);
+    } while (batch && !cmd_done() && buf_stack == r);
+}
+
+/* Interpret one command queued by the web server and complete its request.
+ * Return true if the command was handed to a worker thread.
+ */
+static bool web_run_cmd(void)
+{
+    int connfd;
+    char *p = web_next_cmd(&connfd);
+    if (!p)
+        return false;
+
+    web_connfd = connfd;
+    if (worker_cnt && pool_dispatch(connfd, p)) {
+        free(p);
+        web_connfd = 0;
+        return true;
+    }
+
+    /* With workers, each connection keeps a queue of its own */
+    bool bound = worker_cnt > 0;
+    void *saved = NULL;
+    if (bound) {
+        saved = par_ops->current();
+        void *queue = web_get_data(connfd);
+        par_ops->select(queue ? queue : saved);
+    }
+
+    /* A posted trace holds one command per line, like a command file */
+    for (char *line = p; line && *line && !cmd_done();) {
+        char *eol = strchr(line, '\n');
+        if (eol)
+            *eol = '\0';
+        if (echo)
+            report(1, "%s%s", prompt, line);
+        interpret_cmd(line);
+        web_flush(connfd);
+        line = eol ? eol + 1 : NULL;
+    }
+    free(p);
+
+    if (bound) {
+        web_set_data(connfd, par_ops->current());
+        par_ops->select(saved);
+    }
+    web_connfd = 0;
+    web_done(connfd);
+    return false;
+}
+
 /* Handle command processing in program that uses select as main control loop.
  * Like select, but checks whether command input either present in internal
  * buffer
@@ -553,7 +1356,7 @@ static bool cmd_done()
  * nfds should be set to the maximum file descriptor for network sockets.
  * If nfds == 0, this indicates that there is no pending network activity
  */
-int web_connfd;
+
 static int cmd_select(int nfds,
                       fd_set *readfds,
                       fd_set *writefds,
@@ -562,6 +1365,10 @@ static int cmd_select(int nfds,
 {
     int infd;
     fd_set local_readset;
+    int mux_fd = web_eventmux();
+    struct timeval poll_now = {0, 0}, idle_wait;
+    /* Whether the prompt is already on screen waiting for input */
+    static bool prompted = false;
 
     if (cmd_done())
         return 0;
@@ -576,26 +1383,45 @@ static int cmd_select(int nfds,
         FD_ZERO(readfds);
         FD_SET(infd, readfds);
 
-        /* If web not ready listen */
-        if (web_fd != -1)
-            FD_SET(web_fd, readfds);
+        /* Any activity on web connections wakes up the multiplexer */
+        if (mux_fd >= 0)
+            FD_SET(mux_fd, readfds);
+
+        /* So does a worker completing a command */
+        if (worker_cnt) {
+            FD_SET(done_pipe[0], readfds);
+            if (done_pipe[0] >= nfds)
+                nfds = done_pipe[0] + 1;
+        }
 
-        if (infd == STDIN_FILENO && prompt_flag) {
+        /* Queued web commands must not wait for terminal input */
+        if (web_pending())
+            timeout = &poll_now;
+        else if (infd == STDIN_FILENO && prompt_flag && !prompted) {
             printf("%s", prompt);
             fflush(stdout);
             prompt_flag = true;
+            prompted = true;
+        }
+
+        /* Wake up in time to close idle web connections */
+        int idle_ms = mux_fd >= 0 ? web_timeout() : -1;
+        if (!timeout && idle_ms >= 0) {
+            idle_wait.tv_sec = idle_ms / 1000;
+            idle_wait.tv_usec = (idle_ms % 1000) * 1000;
+            timeout = &idle_wait;
         }
 
         if (infd >= nfds)
             nfds = infd + 1;
-        if (web_fd >= nfds)
-            nfds = web_fd + 1;
+        if (mux_fd >= nfds)
+            nfds = mux_fd + 1;
     }
     if (nfds == 0)
         return 0;
 
     int result = select(nfds, readfds, writefds, exceptfds, timeout);
-    if (result <= 0)
+    if (result < 0)
         return result;
 
     infd = buf_stack->fd;
@@ -605,25 +1431,40 @@ static int cmd_select(int nfds,
         result--;
 
         set_echo(0);
-        char *cmdline = readline();
-        if (cmdline)
-            interpret_cmd(cmdline);
-    } else if (readfds && FD_ISSET(web_fd, readfds)) {
-        FD_CLR(web_fd, readfds);
+        /* Web clients are served between commands of mapped files */
+        if (buf_stack->trace.base) {
+            trace_run(mux_fd < 0);
+        } else if (buf_stack->map) {
+            map_run(mux_fd < 0);
+        } else {
+            char *cmdline = readline();
+            if (cmdline)
+                interpret_cmd(cmdline);
+        }
+        prompted = false;
+    }
+    if (readfds && mux_fd >= 0 && FD_ISSET(mux_fd, readfds)) {
+        /* Accept and read without blocking, complete requests are queued */
+        FD_CLR(mux_fd, readfds);
         result--;
-        struct sockaddr_in clientaddr;
-        socklen_t clientlen = sizeof(clientaddr);
-        web_connfd =
-            accept(web_fd, (struct sockaddr *) &clientaddr, &clientlen);
-
-        char *p = web_recv(web_connfd, &clientaddr);
-        char *buffer = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\n";
-        web_send(web_connfd, buffer);
-
-        if (p)
-            interpret_cmd(p);
-        free(p);
-        close(web_connfd);
+        web_process();
+    } else if (mux_fd >= 0 && result == 0) {
+        /* Timed out, expire idle connections */
+        web_process();
+    }
+    if (readfds && worker_cnt && FD_ISSET(done_pipe[0], readfds)) {
+        FD_CLR(done_pipe[0], readfds);
+        result--;
+        pool_reap();
+    }
+    /* Run one web command at a time on the main thread so console input
+     * stays responsive.  Commands handed to workers are not waited for.
+     */
+    while (!cmd_done() && web_pending()) {
+        if (!web_run_cmd()) {
+            prompted = false;
+            break;
+        }
     }
     return result;
 }
@@ -631,8 +1472,13 @@ static int cmd_select(int nfds,
 bool finish_cmd()
 {
     bool ok = true;
+    pool_stop();
     if (!quit_flag)
         ok = ok && do_quit(0, NULL);
+    if (statfile) {
+        fclose(statfile);
+        statfile = NULL;
+    }
     has_infile = false;
     return ok && err_cnt == 0;
 }
@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <sys/select.h>
 
+#include "histogram.h"
 #include "linenoise.h"
 
 #define HISTORY_FILE ".cmd_history"
@@ -24,7 +25,11 @@ typedef struct __cmd_element {
     cmd_func_t operation;
     char *summary;
     char *param;
+    /* Latency of each execution in nanoseconds, allocated on first use */
+    histogram_t *latency;
     struct __cmd_element *next;
+    /* Next command in the same bucket of the lookup table */
+    struct __cmd_element *hash_next;
 } cmd_element_t;
 
 /* Optionally supply function that gets invoked when parameter changes */
@@ -38,6 +43,7 @@ typedef struct __param_element {
     /* Function that gets called whenever parameter changes */
     setter_func_t setter;
     struct __param_element *next;
+    struct __param_element *hash_next;
 } param_element_t;
 
 /* Initialize interpreter */
@@ -59,6 +65,32 @@ void add_quit_helper(cmd_func_t qf);
 /* Turn echoing on/off */
 void set_echo(bool on);
 
+/* Emit per-command statistics as JSON lines to file.
+ * Return true if the file could be opened.
+ */
+bool set_statfile(char *file_name);
+
+/* Record how many queue operations the running command performed.
+ * Used to derive operations per second, defaults to one per command.
+ */
+void set_cmd_ops(long ops);
+
+/* Hooks letting web commands run on worker threads, see 'option parallel'.
+ * Commands which are not concurrent run on the main thread once every
+ * worker is idle, so they always see a consistent state.
+ */
+typedef struct {
+    /* Return whether the command only touches the current queue */
+    bool (*concurrent)(int argc, char *argv[]);
+    /* Get or set the current queue of the calling thread */
+    void *(*current)(void);
+    void (*select)(void *queue);
+    /* Acquire or release the current queue */
+    void (*lock)(bool acquire);
+} parallel_ops_t;
+
+void set_parallel_ops(const parallel_ops_t *ops);
+
 /* Complete command interpretation */
 
 /* Return true if no errors occurred */
@@ -7,34 +7,21 @@
 #include "queue.h"
 #include "random.h"
 
-/* Maintain a queue independent from the qtest since
- * we do not want the test to affect the original functionality
+/* Maintain queues independent from the qtest since
+ * we do not want the test to affect the original functionality.
+ *
+ * Rather than building a fresh queue for every sample, one queue is kept
+ * per class and grown or shrunk to the size the next sample asks for.
+ * Before every sample, whatever its class, the queue of class 1 moves on to
+ * the next size of an ascending schedule and the queue of class 0 back to
+ * its fixed size.  Both classes thus go through the same untimed steps, and
+ * the caches and the allocator are in the same state when either is timed.
  */
-static struct list_head *l = NULL;
+static struct list_head *queues[2];
+static int sizes[2];
 
-#define dut_new() ((void) (l = q_new()))
-
-#define dut_size(n)                                \
-    do {                                           \
-        for (int __iter = 0; __iter < n; ++__iter) \
-            q_size(l);                             \
-    } while (0)
-
-#define dut_insert_head(s, n)    \
-    do {                         \
-        int j = n;               \
-        while (j--)              \
-            q_insert_head(l, s); \
-    } while (0)
-
-#define dut_insert_tail(s, n)    \
-    do {                         \
-        int j = n;               \
-        while (j--)              \
-            q_insert_tail(l, s); \
-    } while (0)
-
-#define dut_free() ((void) (q_free(l)))
+/* Size of the queue of class 1 when sample i is measured */
+static uint16_t schedule[N_MEASURES];
 
 static char random_string[N_MEASURES][8];
 static int random_string_iter = 0;
@@ -42,7 +29,17 @@ static int random_string_iter = 0;
 /* Implement the necessary queue interface to simulation */
 void init_dut(void)
 {
-    l = NULL;
+    free_dut();
+}
+
+void free_dut(void)
+{
+    for (int k = 0; k < 2; k++) {
+        if (queues[k])
+            q_free(queues[k]);
+        queues[k] = NULL;
+        sizes[k] = 0;
+    }
 }
 
 static char *get_random_string(void)
@@ -51,13 +48,32 @@ static char *get_random_string(void)
     return random_string[random_string_iter];
 }
 
+int input_size(const uint8_t *input_data, size_t i)
+{
+    return *(uint16_t *) (input_data + i * CHUNK_SIZE) % MAX_QUEUE_SIZE;
+}
+
 void prepare_inputs(uint8_t *input_data, uint8_t *classes)
 {
     randombytes(input_data, N_MEASURES * CHUNK_SIZE);
+
+    /* Sort the sizes of all samples into the schedule, so the queue of
+     * class 1 only grows by a few elements from one sample to the next.
+     */
+    for (size_t i = 0; i < N_MEASURES; i++) {
+        uint16_t v = input_size(input_data, i);
+        size_t j = i;
+        for (; j > 0 && schedule[j - 1] > v; j--)
+            schedule[j] = schedule[j - 1];
+        schedule[j] = v;
+    }
+
     for (size_t i = 0; i < N_MEASURES; i++) {
         classes[i] = randombit();
         if (classes[i] == 0)
             memset(input_data + (size_t) i * CHUNK_SIZE, 0, CHUNK_SIZE);
+        else
+            *(uint16_t *) (input_data + i * CHUNK_SIZE) = schedule[i];
     }
 
     for (size_t i = 0; i < N_MEASURES; ++i) {
@@ -67,96 +83,146 @@ void prepare_inputs(uint8_t *input_data, uint8_t *classes)
     }
 }
 
+/* Bring the queue of class k to n elements */
+static bool dut_resize(int k, int n)
+{
+    struct list_head *l = queues[k];
+    if (!l && !(l = queues[k] = q_new()))
+        return false;
+    for (; sizes[k] < n; sizes[k]++) {
+        if (!q_insert_head(l, get_random_string()))
+            return false;
+    }
+    for (; sizes[k] > n; sizes[k]--) {
+        element_t *e = q_remove_head(l, NULL, 0);
+        if (!e)
+            return false;
+        q_release_element(e);
+    }
+    return true;
+}
+
+/* Return the queue sample i is measured on, with base elements for class 0
+ * and base more than its schedule for class 1, or NULL if it cannot be
+ * built.  Both queues are resized whatever the class of the sample.
+ */
+static struct list_head *dut_queue(size_t i, int base, const uint8_t *classes)
+{
+    if (!dut_resize(1, base + schedule[i]) || !dut_resize(0, base))
+        return NULL;
+    return queues[classes[i]];
+}
+
 bool measure(int64_t *before_ticks,
              int64_t *after_ticks,
-             uint8_t *input_data,
+             const uint8_t *input_data,
+             const uint8_t *classes,
              int mode)
 {
-    assert(mode == DUT(insert_head) || mode == DUT(insert_tail) ||
-           mode == DUT(remove_head) || mode == DUT(remove_tail));
-
+    struct list_head *l;
     switch (mode) {
     case DUT(insert_head):
         for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
             char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
-            dut_insert_head(s, 1);
-            after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
-            dut_free();
-            if (before_size != after_size - 1)
+            if (!(l = dut_queue(i, 0, classes)))
+                return false;
+            before_ticks[i] = cpucycles_sample();
+            bool ok = q_insert_head(l, s);
+            after_ticks[i] = cpucycles_sample();
+            if (!ok)
                 return false;
+            sizes[classes[i]]++;
         }
         break;
     case DUT(insert_tail):
         for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
             char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
-            dut_insert_tail(s, 1);
-            after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
-            dut_free();
-            if (before_size != after_size - 1)
+            if (!(l = dut_queue(i, 0, classes)))
                 return false;
+            before_ticks[i] = cpucycles_sample();
+            bool ok = q_insert_tail(l, s);
+            after_ticks[i] = cpucycles_sample();
+            if (!ok)
+                return false;
+            sizes[classes[i]]++;
         }
         break;
     case DUT(remove_head):
         for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 + 1);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
+            if (!(l = dut_queue(i, 1, classes)))
+                return false;
+            before_ticks[i] = cpucycles_sample();
             element_t *e = q_remove_head(l, NULL, 0);
-            after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
-            if (e)
-                q_release_element(e);
-            dut_free();
-            if (before_size != after_size + 1)
+            after_ticks[i] = cpucycles_sample();
+            if (!e)
                 return false;
+            q_release_element(e);
+            sizes[classes[i]]--;
         }
         break;
     case DUT(remove_tail):
         for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 + 1);
-            int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
+            if (!(l = dut_queue(i, 1, classes)))
+                return false;
+            before_ticks[i] = cpucycles_sample();
             element_t *e = q_remove_tail(l, NULL, 0);
-            after_ticks[i] = cpucycles();
-            int after_size = q_size(l);
-            if (e)
-                q_release_element(e);
-            dut_free();
-            if (before_size != after_size + 1)
+            after_ticks[i] = cpucycles_sample();
+            if (!e)
                 return false;
+            q_release_element(e);
+            sizes[classes[i]]--;
         }
         break;
-    default:
+    case DUT(size):
         for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            before_ticks[i] = cpucycles();
-            dut_size(1);
-            after_ticks[i] = cpucycles();
-            dut_free();
+            if (!(l = dut_queue(i, LINEAR_BASE_SIZE, classes)))
+                return false;
+            before_ticks[i] = cpucycles_sample();
+            int size = q_size(l);
+            after_ticks[i] = cpucycles_sample();
+            if (size != sizes[classes[i]])
+                return false;
+        }
+        break;
+    case DUT(delete_mid):
+        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
+            if (!(l = dut_queue(i, LINEAR_BASE_SIZE + 1, classes)))
+                return false;
+            before_ticks[i] = cpucycles_sample();
+            bool ok = q_delete_mid(l);
+            after_ticks[i] = cpucycles_sample();
+            if (!ok)
+                return false;
+            sizes[classes[i]]--;
         }
+        break;
+    case DUT(swap):
+        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
+            if (!(l = dut_queue(i, LINEAR_BASE_SIZE, classes)))
+                return false;
+            before_ticks[i] = cpucycles_sample();
+            q_swap(l);
+            after_ticks[i] = cpucycles_sample();
+        }
+        break;
+    case DUT(reverse):
+        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
+            if (!(l = dut_queue(i, LINEAR_BASE_SIZE, classes)))
+                return false;
+            before_ticks[i] = cpucycles_sample();
+            q_reverse(l);
+            after_ticks[i] = cpucycles_sample();
+        }
+        break;
+    default:
+        assert(0 && "unknown mode");
+        return false;
+    }
+
+    /* Walk the queues once per batch to catch a miscounting implementation */
+    for (int k = 0; k < 2; k++) {
+        if (queues[k] && q_size(queues[k]) != sizes[k])
+            return false;
     }
     return true;
 }
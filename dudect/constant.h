@@ -2,6 +2,7 @@
 #define DUDECT_CONSTANT_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 /* Number of measurements per test */
@@ -12,25 +13,50 @@
 
 #define DROP_SIZE 20
 
+/* Queues are measured with fewer elements than this */
+#define MAX_QUEUE_SIZE 10000
+
+/* Linear operations are measured on this many more elements, so the fixed
+ * cost of a call is small next to the cost per element
+ */
+#define LINEAR_BASE_SIZE 500
+
+/* Operations expected to take constant time */
 #define DUT_FUNCS  \
     _(insert_head) \
     _(insert_tail) \
     _(remove_head) \
     _(remove_tail)
 
+/* Operations expected to take time linear in the size of the queue */
+#define DUT_LINEAR_FUNCS \
+    _(size)              \
+    _(delete_mid)        \
+    _(swap)              \
+    _(reverse)
+
 #define DUT(x) DUT_##x
 
 enum {
 #define _(x) DUT(x),
     DUT_FUNCS
+    DUT_LINEAR_FUNCS
 #undef _
 };
 
 void init_dut();
+/* Release the queues kept between measurements */
+void free_dut();
 void prepare_inputs(uint8_t *input_data, uint8_t *classes);
+/* Number of elements sample i is measured on, give or take one, not counting
+ * LINEAR_BASE_SIZE
+ */
+int input_size(const uint8_t *input_data, size_t i);
+/* Time mode on every sample of input_data, each on the queue of its class */
 bool measure(int64_t *before_ticks,
              int64_t *after_ticks,
-             uint8_t *input_data,
+             const uint8_t *input_data,
+             const uint8_t *classes,
              int mode);
 
 #endif
@@ -0,0 +1,126 @@
+/* Cycle counter calibration and the perf_event_open(2) backend */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "cpucycles.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#define CALIBRATION_ROUNDS 1000
+
+int cpucycles_source = CPUCYCLES_TSC;
+int64_t cpucycles_overhead = 0;
+
+#if defined(__linux__)
+static int perf_fd = -1;
+
+/* Page the kernel updates to let rdpmc read the counter without a syscall */
+static struct perf_event_mmap_page *perf_page = NULL;
+
+static void perf_release(void)
+{
+    if (perf_page)
+        munmap(perf_page, sysconf(_SC_PAGESIZE));
+    if (perf_fd >= 0)
+        close(perf_fd);
+    perf_page = NULL;
+    perf_fd = -1;
+}
+
+static bool perf_acquire(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    /* perf_event_paranoid <= 2 only permits user space counting */
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    /* Count the calling thread on any CPU */
+    perf_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (perf_fd < 0)
+        return false;
+
+    void *p = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED,
+                   perf_fd, 0);
+    perf_page = p == MAP_FAILED ? NULL : p;
+    return true;
+}
+
+int64_t cpucycles_perf(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    /* Self-monitoring as described in <linux/perf_event.h> */
+    struct perf_event_mmap_page *pc = perf_page;
+    if (pc && pc->cap_user_rdpmc) {
+        uint32_t seq, idx;
+        int64_t count;
+        do {
+            seq = pc->lock;
+            __asm__ volatile("" ::: "memory");
+            idx = pc->index;
+            count = pc->offset;
+            if (idx) {
+                unsigned int hi, lo;
+                __asm__ volatile("lfence\n\trdpmc\n\tlfence"
+                                 : "=a"(lo), "=d"(hi)
+                                 : "c"(idx - 1));
+                int64_t pmc = ((int64_t) lo) | (((int64_t) hi) << 32);
+                int shift = 64 - pc->pmc_width;
+                count += (int64_t) ((uint64_t) pmc << shift) >> shift;
+            }
+            __asm__ volatile("" ::: "memory");
+        } while (pc->lock != seq);
+        if (idx)
+            return count;
+    }
+#endif
+    uint64_t val;
+    if (read(perf_fd, &val, sizeof(val)) != sizeof(val))
+        return 0;
+    return val;
+}
+#else  /* !__linux__ */
+static void perf_release(void) {}
+
+static bool perf_acquire(void)
+{
+    return false;
+}
+
+int64_t cpucycles_perf(void)
+{
+    return 0;
+}
+#endif
+
+bool cpucycles_set_source(int source)
+{
+    /* Counters opened by another process or thread count its cycles */
+    perf_release();
+    cpucycles_source = CPUCYCLES_TSC;
+    if (source == CPUCYCLES_PERF && perf_acquire())
+        cpucycles_source = CPUCYCLES_PERF;
+    cpucycles_calibrate();
+    return cpucycles_source == source;
+}
+
+void cpucycles_calibrate(void)
+{
+    /* The cheapest round is the cost of the readings alone */
+    int64_t best = INT64_MAX;
+    for (int i = 0; i < CALIBRATION_ROUNDS; i++) {
+        int64_t start = cpucycles_start();
+        int64_t stop = cpucycles_stop();
+        if (stop - start >= 0 && stop - start < best)
+            best = stop - start;
+    }
+    cpucycles_overhead = best == INT64_MAX ? 0 : best;
+}
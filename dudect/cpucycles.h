@@ -1,6 +1,7 @@
 #ifndef DUDECT_CPUCYCLES_H
 #define DUDECT_CPUCYCLES_H
 
+#include <stdbool.h>
 #include <stdint.h>
 
 // http://www.intel.com/content/www/us/en/embedded/training/ia-32-ia-64-benchmark-code-execution-paper.html
@@ -26,4 +27,96 @@ static inline int64_t cpucycles(void)
 #endif
 }
 
+/* Where cpucycles_start() and cpucycles_stop() read the time from */
+enum {
+    CPUCYCLES_TSC = 0, /* Time stamp counter, or the ARM system counter */
+    CPUCYCLES_PERF,    /* Core cycles of this thread, see perf_event_open(2) */
+};
+
+extern int cpucycles_source;
+
+/* Fixed cost of a pair of readings, subtracted by cpucycles_elapsed() */
+extern int64_t cpucycles_overhead;
+
+/* Read the cycle counter of the perf backend */
+int64_t cpucycles_perf(void);
+
+/* Switch to source, (re)opening the counter for the calling thread.
+ * Return false and fall back to the time stamp counter if it is not
+ * available.  Forked processes call it again to count their own cycles.
+ */
+bool cpucycles_set_source(int source);
+
+/* Measure cpucycles_overhead on the CPU this runs on */
+void cpucycles_calibrate(void);
+
+/* Reading taken before the measured code.  Unlike a bare rdtsc, which may
+ * execute before earlier instructions complete or after later ones start,
+ * the fences keep the reading in place.  On CPUs with an invariant TSC
+ * (constant_tsc and nonstop_tsc in /proc/cpuinfo) it ticks at a constant
+ * rate whatever the frequency or power state of the core.
+ */
+static inline int64_t cpucycles_start(void)
+{
+    if (cpucycles_source == CPUCYCLES_PERF)
+        return cpucycles_perf();
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int hi, lo;
+    __asm__ volatile("lfence\n\trdtsc\n\tlfence"
+                     : "=a"(lo), "=d"(hi)::"memory");
+    return ((int64_t) lo) | (((int64_t) hi) << 32);
+#elif defined(__aarch64__)
+    uint64_t val;
+    asm volatile("isb\n\tmrs %0, cntvct_el0\n\tisb" : "=r"(val)::"memory");
+    return val;
+#else
+    return cpucycles();
+#endif
+}
+
+/* Reading taken after the measured code.  rdtscp waits for the code to
+ * complete, and the fence keeps what follows from starting early.
+ */
+static inline int64_t cpucycles_stop(void)
+{
+    if (cpucycles_source == CPUCYCLES_PERF)
+        return cpucycles_perf();
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int hi, lo, aux;
+    __asm__ volatile("rdtscp\n\tlfence"
+                     : "=a"(lo), "=d"(hi), "=c"(aux)::"memory");
+    return ((int64_t) lo) | (((int64_t) hi) << 32);
+#elif defined(__aarch64__)
+    uint64_t val;
+    asm volatile("isb\n\tmrs %0, cntvct_el0\n\tisb" : "=r"(val)::"memory");
+    return val;
+#else
+    return cpucycles();
+#endif
+}
+
+/* Bare reading for dudect.  Fenced readings also time the few cycles a
+ * cache miss or a store forwarding stall adds to a constant time operation
+ * on one queue but not on another, and the t-tests take that for a leak.
+ * The difference of two readings is all the t-tests need, as the cost of
+ * the readings shifts both classes alike.
+ */
+static inline int64_t cpucycles_sample(void)
+{
+    if (cpucycles_source == CPUCYCLES_PERF)
+        return cpucycles_perf();
+    return cpucycles();
+}
+
+/* Cycles spent between two readings, without the cost of the readings.
+ * Readings which are not in order give 0.  As the cost is that of the
+ * cheapest pair of readings, code cheaper than the noise may come out a
+ * few cycles below 0.
+ */
+static inline int64_t cpucycles_elapsed(int64_t start, int64_t stop)
+{
+    int64_t d = stop - start;
+    return d > 0 ? d - cpucycles_overhead : 0;
+}
+
 #endif
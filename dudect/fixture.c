@@ -26,24 +26,72 @@
  *    variable time.
  */
 
+/* sched_setaffinity() and the CPU_* macros */
+#if defined(__linux__)
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
+
 #include <assert.h>
+#include <errno.h>
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "../console.h"
 #include "../random.h"
 
 #include "constant.h"
+#include "cpucycles.h"
 #include "fixture.h"
 #include "ttest.h"
 
 #define ENOUGH_MEASURE 10000
 #define TEST_TRIES 10
 
+/* Batches of N_MEASURES needed to reach ENOUGH_MEASURE */
+#define N_BATCHES (ENOUGH_MEASURE / (N_MEASURES - DROP_SIZE * 2) + 1)
+
+#define MAX_WORKERS 64
+
+/* Cropped tests, the uncropped test and the second order test */
+#define N_PERCENTILES 100
+#define N_TESTS (N_PERCENTILES + 2)
+#define SECOND_ORDER (N_PERCENTILES + 1)
+
+/* Percentile keeping about the fastest 90% of the measurements */
+#define CALIB_CROP (N_PERCENTILES / 3)
+
+/* Tests over a subset of the measurements count once each class has this
+ * many in it.  Cropping to the fastest few percent leaves values so close
+ * together that a difference of a cycle or two would stand out.
+ */
+#define ENOUGH_SUBSET (ENOUGH_MEASURE / 4)
+
+/* Linear operations may cost this many times more per element on the larger
+ * queues, which leaves room for cache misses but not for quadratic time.
+ */
+#define LINEAR_SLACK 4
+
+int dudect_workers = 0;
+
+/* t[0] is the uncropped test, t[i] keeps measurements below percentiles[i-1]
+ * and t[SECOND_ORDER] tests the squared distance from the class means.
+ */
 static t_context_t *t;
+static int64_t percentiles[N_PERCENTILES];
+
+/* Means of each class in the calibration batch, which the second order
+ * test centers on.  Workers inherit them along with the percentiles.
+ */
+static t_context_t calib;
+
+/* Whether the operation under test is expected to take linear time */
+static bool linear;
 
 /* threshold values for Welch's t-test */
 enum {
@@ -64,6 +112,60 @@ static void differentiate(int64_t *exec_times,
         exec_times[i] = after_ticks[i] - before_ticks[i];
 }
 
+static int cmp_ticks(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Set the cropping thresholds from the execution times of one batch.
+ * Percentile i keeps the fastest 1 - 0.5^(10 * (i + 1) / N_PERCENTILES)
+ * of the measurements, so most thresholds sit in the fat right tail.
+ */
+static void prepare_percentiles(const int64_t *exec_times)
+{
+    const size_t n = N_MEASURES - DROP_SIZE * 2;
+    int64_t sorted[N_MEASURES];
+    memcpy(sorted, exec_times + DROP_SIZE, n * sizeof(int64_t));
+    qsort(sorted, n, sizeof(int64_t), cmp_ticks);
+
+    for (size_t i = 0; i < N_PERCENTILES; i++) {
+        double which = 1 - pow(0.5, 10 * (double) (i + 1) / N_PERCENTILES);
+        percentiles[i] = sorted[(size_t) (which * n)];
+    }
+}
+
+/* Set the means the second order test centers on from one batch.  Those
+ * only see the fastest 90% of it, as one interrupted run of so few would
+ * move the center of its class far off.
+ */
+static void prepare_means(const int64_t *exec_times, const uint8_t *classes)
+{
+    t_init(&calib);
+    for (size_t i = 0; i < N_MEASURES; i++) {
+        if (exec_times[i] > 0 && exec_times[i] < percentiles[CALIB_CROP])
+            t_push(&calib, exec_times[i], classes[i]);
+    }
+}
+
+/* Turn the measurements of a linear operation into cycles per element,
+ * scaled by 1024 to keep the precision.  Class 1, measured on the larger
+ * queues, is allowed LINEAR_SLACK times the cost per element of class 0.
+ */
+static void per_element(int64_t *exec_times,
+                        const uint8_t *input_data,
+                        const uint8_t *classes)
+{
+    for (size_t i = 0; i < N_MEASURES; i++) {
+        if (exec_times[i] <= 0)
+            continue;
+        int64_t n = LINEAR_BASE_SIZE + input_size(input_data, i);
+        exec_times[i] = exec_times[i] * 1024 / n;
+        if (classes[i])
+            exec_times[i] /= LINEAR_SLACK;
+    }
+}
+
 static void update_statistics(const int64_t *exec_times, uint8_t *classes)
 {
     for (size_t i = 0; i < N_MEASURES; i++) {
@@ -73,21 +175,69 @@ static void update_statistics(const int64_t *exec_times, uint8_t *classes)
             continue;
 
         /* do a t-test on the execution time */
-        t_push(t, difference, classes[i]);
+        t_push(&t[0], difference, classes[i]);
+
+        /* and on the measurements below each percentile */
+        for (size_t crop = 0; crop < N_PERCENTILES; crop++) {
+            if (difference < percentiles[crop])
+                t_push(&t[crop + 1], difference, classes[i]);
+        }
+
+        /* Second order test, once calibration has seen both classes */
+        if (calib.n[0] && calib.n[1]) {
+            double centered = difference - calib.mean[classes[i]];
+            t_push(&t[SECOND_ORDER], centered * centered, classes[i]);
+        }
     }
 }
 
+static void init_tests(void)
+{
+    for (int i = 0; i < N_TESTS; i++)
+        t_init(&t[i]);
+}
+
+/* t value of a test.  Linear operations only fail when the larger queues
+ * cost more per element, not when they cost less.
+ */
+static double t_value(t_context_t *ctx)
+{
+    double x = t_compute(ctx);
+    return linear ? -x : fabs(x);
+}
+
+/* Index of the test with the largest t value.  Tests over a subset of the
+ * measurements only count once both classes have enough of them.
+ */
+static int max_test(void)
+{
+    int ret = 0;
+    double max = t_value(&t[0]);
+    for (int i = 1; i < N_TESTS; i++) {
+        if (t[i].n[0] < ENOUGH_SUBSET || t[i].n[1] < ENOUGH_SUBSET)
+            continue;
+        double x = t_value(&t[i]);
+        if (max < x) {
+            max = x;
+            ret = i;
+        }
+    }
+    return ret;
+}
+
 static bool report(void)
 {
-    double max_t = fabs(t_compute(t));
-    double number_traces_max_t = t->n[0] + t->n[1];
+    double number_traces = t[0].n[0] + t[0].n[1];
+    int mt = max_test();
+    double max_t = t_value(&t[mt]);
+    double number_traces_max_t = t[mt].n[0] + t[mt].n[1];
     double max_tau = max_t / sqrt(number_traces_max_t);
 
     printf("\033[A\033[2K");
-    printf("meas: %7.2lf M, ", (number_traces_max_t / 1e6));
-    if (number_traces_max_t < ENOUGH_MEASURE) {
+    printf("meas: %7.2lf M, ", (number_traces / 1e6));
+    if (number_traces < ENOUGH_MEASURE) {
         printf("not enough measurements (%.0f still to go).\n",
-               ENOUGH_MEASURE - number_traces_max_t);
+               ENOUGH_MEASURE - number_traces);
         return false;
     }
 
@@ -116,7 +266,10 @@ static bool report(void)
     return true;
 }
 
-static bool doit(int mode)
+/* Measure one batch and add it to t, without reporting.  A calibration
+ * batch only sets the percentiles and the class means.
+ */
+static bool measure_batch(int mode, bool calibrate)
 {
     int64_t *before_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
     int64_t *after_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
@@ -131,10 +284,15 @@ static bool doit(int mode)
 
     prepare_inputs(input_data, classes);
 
-    bool ret = measure(before_ticks, after_ticks, input_data, mode);
+    bool ret = measure(before_ticks, after_ticks, input_data, classes, mode);
     differentiate(exec_times, before_ticks, after_ticks);
-    update_statistics(exec_times, classes);
-    ret &= report();
+    if (linear)
+        per_element(exec_times, input_data, classes);
+    if (calibrate) {
+        prepare_percentiles(exec_times);
+        prepare_means(exec_times, classes);
+    } else
+        update_statistics(exec_times, classes);
 
     free(before_ticks);
     free(after_ticks);
@@ -145,34 +303,200 @@ static bool doit(int mode)
     return ret;
 }
 
-static void init_once(void)
+static bool doit(int mode)
+{
+    bool ret = measure_batch(mode, false);
+    ret &= report();
+    return ret;
+}
+
+/* Set the percentiles and the class means from a batch measured once per
+ * test and then discarded, as the first runs warm up the caches
+ */
+static bool calibrate(int mode)
 {
     init_dut();
-    t_init(t);
+    return measure_batch(mode, true);
+}
+
+/* Fill cpus with the CPUs workers may be pinned to, return their count.
+ * CPUs isolated from the scheduler (isolcpus=) are preferred as they see
+ * the least interference, otherwise those this process may run on are used.
+ */
+static int pick_cpus(int *cpus, int max)
+{
+    int n = 0;
+#if defined(__linux__)
+    FILE *f = fopen("/sys/devices/system/cpu/isolated", "r");
+    if (f) {
+        int lo, hi;
+        char sep;
+        while (n < max && fscanf(f, "%d", &lo) == 1) {
+            hi = lo;
+            sep = fgetc(f);
+            if (sep == '-' && fscanf(f, "%d", &hi) == 1)
+                sep = fgetc(f);
+            for (int cpu = lo; cpu <= hi && n < max; cpu++)
+                cpus[n++] = cpu;
+            if (sep != ',')
+                break;
+        }
+        fclose(f);
+    }
+    if (n)
+        return n;
+
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set))
+        return 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++) {
+        if (CPU_ISSET(cpu, &set))
+            cpus[n++] = cpu;
+    }
+#endif
+    return n;
+}
+
+/* What a worker sends back through its pipe */
+typedef struct {
+    t_context_t t[N_TESTS];
+    bool ok;
+} worker_result_t;
+
+/* Write or read all of buf through the pipe fd */
+static bool transfer(int fd, void *buf, size_t size, bool out)
+{
+    char *p = buf;
+    while (size) {
+        ssize_t len = out ? write(fd, p, size) : read(fd, p, size);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            return false;
+        p += len;
+        size -= len;
+    }
+    return true;
+}
+
+/* Body of a worker process: measure batches on its own CPU */
+static void __attribute__((noreturn))
+worker(int cpu, int mode, int batches, int fd)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    sched_setaffinity(0, sizeof(set), &set);
+#endif
+    /* Count the cycles of this process */
+    cpucycles_set_source(cpucycles_source);
+    worker_result_t r = {.ok = true};
+    /* Percentiles, class means and queues are inherited from the parent */
+    init_tests();
+    for (int i = 0; i < batches; i++)
+        r.ok &= measure_batch(mode, false);
+    memcpy(r.t, t, sizeof(r.t));
+
+    /* Skip atexit() handlers and stdio buffers inherited from qtest */
+    _exit(transfer(fd, &r, sizeof(r), true) ? 0 : 1);
+}
+
+/* Spread the batches of one try over pinned worker processes and merge
+ * their statistics into t.  Batches of workers which could not be forked
+ * are measured here.
+ */
+static bool measure_parallel(int mode, const int *cpus, int workers)
+{
+    int per_worker = (N_BATCHES + workers - 1) / workers;
+    pid_t pids[MAX_WORKERS];
+    int fds[MAX_WORKERS];
+    int started = 0;
+    bool ok = true;
+
+    /* Children must not flush what is buffered here once more */
+    fflush(stdout);
+    init_tests();
+    for (; started < workers; started++) {
+        int p[2];
+        if (pipe(p) < 0)
+            break;
+        pids[started] = fork();
+        if (pids[started] == 0) {
+            close(p[0]);
+            worker(cpus[started], mode, per_worker, p[1]);
+        }
+        close(p[1]);
+        if (pids[started] < 0) {
+            close(p[0]);
+            break;
+        }
+        fds[started] = p[0];
+    }
+
+    for (int i = started * per_worker; i < workers * per_worker; i++)
+        ok &= measure_batch(mode, false);
+
+    for (int i = 0; i < started; i++) {
+        worker_result_t r;
+        bool got = transfer(fds[i], &r, sizeof(r), false);
+        close(fds[i]);
+        waitpid(pids[i], NULL, 0);
+        if (!got) {
+            ok = false;
+            continue;
+        }
+        for (int j = 0; j < N_TESTS; j++)
+            t_merge(&t[j], &r.t[j]);
+        ok &= r.ok;
+    }
+    return ok;
 }
 
-static bool test_const(char *text, int mode)
+static bool test_const(char *text, int mode, bool is_linear)
 {
     bool result = false;
-    t = malloc(sizeof(t_context_t));
+    linear = is_linear;
+    t = malloc(N_TESTS * sizeof(t_context_t));
+
+    int cpus[MAX_WORKERS];
+    int workers = dudect_workers > MAX_WORKERS ? MAX_WORKERS : dudect_workers;
+    /* One worker per CPU, sharing one would only add noise */
+    if (workers > 0) {
+        int n = pick_cpus(cpus, workers);
+        workers = n < workers ? n : workers;
+    }
 
+    bool ok = calibrate(mode);
     for (int cnt = 0; cnt < TEST_TRIES; ++cnt) {
         printf("Testing %s...(%d/%d)\n\n", text, cnt, TEST_TRIES);
-        init_once();
-        for (int i = 0; i < ENOUGH_MEASURE / (N_MEASURES - DROP_SIZE * 2) + 1;
-             ++i)
-            result = doit(mode);
+        if (workers > 0) {
+            ok &= measure_parallel(mode, cpus, workers);
+            result = report() && ok;
+        } else {
+            init_tests();
+            for (int i = 0; i < N_BATCHES; ++i)
+                result = doit(mode) && ok;
+        }
         printf("\033[A\033[2K\033[A\033[2K");
         if (result)
             break;
     }
+    free_dut();
     free(t);
     return result;
 }
 
 #define DUT_FUNC_IMPL(op) \
-    bool is_##op##_const(void) { return test_const(#op, DUT(op)); }
+    bool is_##op##_const(void) { return test_const(#op, DUT(op), false); }
+
+#define DUT_LINEAR_FUNC_IMPL(op) \
+    bool is_##op##_linear(void) { return test_const(#op, DUT(op), true); }
 
 #define _(x) DUT_FUNC_IMPL(x)
 DUT_FUNCS
 #undef _
+
+#define _(x) DUT_LINEAR_FUNC_IMPL(x)
+DUT_LINEAR_FUNCS
+#undef _
@@ -4,9 +4,19 @@
 #include <stdbool.h>
 #include "constant.h"
 
+/* Number of processes measuring in parallel, each pinned to its own CPU.
+ * 0 measures in the calling process.
+ */
+extern int dudect_workers;
+
 /* Interface to test if function is constant */
 #define _(x) bool is_##x##_const(void);
 DUT_FUNCS
 #undef _
 
+/* Interface to test if function takes time linear in the queue size */
+#define _(x) bool is_##x##_linear(void);
+DUT_LINEAR_FUNCS
+#undef _
+
 #endif
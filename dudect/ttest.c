@@ -38,6 +38,23 @@ double t_compute(t_context_t *ctx)
     return t_value;
 }
 
+/* Combine two partial Welford accumulators, see Chan et al., "Updating
+ * Formulae and a Pairwise Algorithm for Computing Sample Variances".
+ */
+void t_merge(t_context_t *ctx, const t_context_t *src)
+{
+    for (int class = 0; class < 2; class ++) {
+        double n = ctx->n[class] + src->n[class];
+        if (n == 0)
+            continue;
+        double delta = src->mean[class] - ctx->mean[class];
+        ctx->mean[class] += delta * src->n[class] / n;
+        ctx->m2[class] += src->m2[class] +
+                          delta * delta * ctx->n[class] * src->n[class] / n;
+        ctx->n[class] = n;
+    }
+}
+
 void t_init(t_context_t *ctx)
 {
     for (int class = 0; class < 2; class ++) {
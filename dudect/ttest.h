@@ -13,4 +13,7 @@ void t_push(t_context_t *ctx, double x, uint8_t class);
 double t_compute(t_context_t *ctx);
 void t_init(t_context_t *ctx);
 
+/* Add the measurements accumulated in src to ctx */
+void t_merge(t_context_t *ctx, const t_context_t *src);
+
 #endif
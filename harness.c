@@ -1,11 +1,17 @@
 /* Test support code */
 
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#if defined(__GLIBC__)
+#include <malloc.h> /* malloc_usable_size */
+#elif defined(__APPLE__)
+#include <malloc/malloc.h> /* malloc_size */
+#endif
 
 #include "report.h"
 
@@ -43,20 +49,53 @@ typedef struct __block_element {
 static block_element_t *allocated = NULL;
 static size_t allocated_count = 0;
 
+/* Allocation statistics */
+static size_t malloc_count = 0;
+static size_t free_count = 0;
+static size_t allocated_bytes = 0;
+
+/* Peak tracking follows the calling thread, so commands running on other
+ * threads at the same time do not show up in its peak.  thread_bytes is
+ * what the thread allocated less what it freed, thread_offset makes up the
+ * rest of the live bytes as of when the peak was last set.
+ */
+static __thread long thread_bytes = 0;
+static __thread long thread_offset = 0;
+static __thread size_t thread_peak = 0;
+
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
-static bool cautious_mode = true;
-static bool noallocate_mode = false;
-static bool error_occurred = false;
-static char *error_message = "";
+/* Modes and errors apply to the operation running on the calling thread */
+static __thread bool cautious_mode = true;
+static __thread bool noallocate_mode = false;
+static __thread bool error_occurred = false;
+static __thread char *error_message = "";
+
+/* Seconds a risky operation may run before it is aborted, 0 = unlimited */
+int time_limit = 1;
+
+/* Data for managing exceptions, one set per thread */
+static __thread jmp_buf env;
+static __thread volatile sig_atomic_t jmp_ready = false;
+static __thread bool time_limited = false;
+static __thread bool alarm_mode = true;
 
-static int time_limit = 1;
+/* Serialize the list of allocated blocks once threads are involved */
+static bool threaded_mode = false;
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
 
-/* Data for managing exceptions */
-static jmp_buf env;
-static volatile sig_atomic_t jmp_ready = false;
-static bool time_limited = false;
+static inline void alloc_lock_acquire(void)
+{
+    if (threaded_mode)
+        pthread_mutex_lock(&alloc_lock);
+}
+
+static inline void alloc_lock_release(void)
+{
+    if (threaded_mode)
+        pthread_mutex_unlock(&alloc_lock);
+}
 
 /* Internal functions */
 
@@ -143,6 +182,7 @@ void *test_malloc(size_t size)
     *find_footer(new_block) = MAGICFOOTER;
     void *p = (void *) &new_block->payload;
     memset(p, FILLCHAR, size);
+    alloc_lock_acquire();
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->next = allocated;
     // cppcheck-suppress nullPointerRedundantCheck
@@ -153,6 +193,14 @@ void *test_malloc(size_t size)
     allocated = new_block;
     allocated_count++;
 
+    malloc_count++;
+    allocated_bytes += size;
+    alloc_lock_release();
+
+    thread_bytes += size;
+    if (thread_offset + thread_bytes > (long) thread_peak)
+        thread_peak = thread_offset + thread_bytes;
+
     return p;
 }
 
@@ -178,6 +226,7 @@ void test_free(void *p)
     if (!p)
         return;
 
+    alloc_lock_acquire();
     block_element_t *b = find_header(p);
     size_t footer = *find_footer(b);
     if (footer != MAGICFOOTER) {
@@ -201,8 +250,12 @@ void test_free(void *p)
     if (bn)
         bn->prev = bp;
 
+    allocated_bytes -= b->payload_size;
+    thread_bytes -= b->payload_size;
     free(b);
     allocated_count--;
+    free_count++;
+    alloc_lock_release();
 }
 
 // cppcheck-suppress unusedFunction
@@ -221,6 +274,51 @@ size_t allocation_check()
     return allocated_count;
 }
 
+void alloc_stats(alloc_stats_t *s)
+{
+    alloc_lock_acquire();
+    s->malloc_cnt = malloc_count;
+    s->free_cnt = free_count;
+    s->live_blocks = allocated_count;
+    s->live_bytes = allocated_bytes;
+    alloc_lock_release();
+    s->peak_bytes = thread_peak;
+}
+
+void alloc_stats_set_peak(size_t peak)
+{
+    alloc_lock_acquire();
+    thread_offset = allocated_bytes - thread_bytes;
+    thread_peak = peak > allocated_bytes ? peak : allocated_bytes;
+    alloc_lock_release();
+}
+
+bool block_info(void *p, block_info_t *info)
+{
+    if (!p)
+        return false;
+
+    /* Same layout check as find_header(), without reporting errors */
+    block_element_t *b =
+        (block_element_t *) ((size_t) p - sizeof(block_element_t));
+    if (b->magic_header != MAGICHEADER || *find_footer(b) != MAGICFOOTER)
+        return false;
+
+    size_t requested = b->payload_size + sizeof(block_element_t) +
+                       sizeof(size_t);
+    info->payload = b->payload_size;
+    info->harness = requested - b->payload_size;
+#if defined(__GLIBC__)
+    /* Usable size rounding plus the size field of each in-use chunk */
+    info->system = malloc_usable_size(b) - requested + sizeof(size_t);
+#elif defined(__APPLE__)
+    info->system = malloc_size(b) - requested;
+#else
+    info->system = 0;
+#endif
+    return true;
+}
+
 /* Implementation of functions for testing */
 
 /* Set/unset cautious mode.
@@ -239,6 +337,22 @@ void set_noallocate_mode(bool noallocate)
     noallocate_mode = noallocate;
 }
 
+/* Set/unset threaded mode.
+ * In this mode, blocks may be allocated and freed from several threads.
+ */
+void set_threaded_mode(bool threaded)
+{
+    threaded_mode = threaded;
+}
+
+/* Enable/disable time limits for the calling thread.
+ * The limit relies on alarm(), which is shared by the whole process.
+ */
+void set_alarm_mode(bool enable)
+{
+    alarm_mode = enable;
+}
+
 /* Return whether any errors have occurred since last time set error limit */
 bool error_check()
 {
@@ -268,7 +382,7 @@ bool exception_setup(bool limit_time)
 
     /* Got here from initial call */
     jmp_ready = true;
-    if (limit_time) {
+    if (limit_time && alarm_mode) {
         alarm(time_limit);
         time_limited = true;
     }
@@ -21,9 +21,42 @@ char *test_strdup(const char *s);
 /* Report number of allocated blocks */
 size_t allocation_check();
 
+/* Statistics on blocks handed out by test_malloc */
+typedef struct {
+    size_t malloc_cnt;  /* Number of successful allocations */
+    size_t free_cnt;    /* Number of blocks released */
+    size_t live_blocks; /* Blocks currently allocated */
+    size_t live_bytes;  /* Payload bytes currently allocated */
+    size_t peak_bytes;  /* Maximum of live_bytes since peak was last set,
+                         * only counting what the calling thread allocated
+                         */
+} alloc_stats_t;
+
+void alloc_stats(alloc_stats_t *s);
+
+/* Restart peak tracking of the calling thread from the larger of peak and
+ * current live bytes
+ */
+void alloc_stats_set_peak(size_t peak);
+
+/* Memory actually consumed by a block handed out by test_malloc */
+typedef struct {
+    size_t payload;  /* Bytes requested by the caller */
+    size_t harness;  /* Header and footer added by test_malloc */
+    size_t system;   /* System allocator header and rounding slack */
+} block_info_t;
+
+/* Fill info for block p.
+ * Return false if p does not point to the start of an allocated block.
+ */
+bool block_info(void *p, block_info_t *info);
+
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/* Time limit of a risky operation in seconds, 0 disables the limit */
+extern int time_limit;
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -36,6 +69,18 @@ void set_cautious_mode(bool cautious);
  */
 void set_noallocate_mode(bool noallocate);
 
+/*
+ * Set/unset threaded mode.
+ * In this mode, blocks may be allocated and freed from several threads.
+ */
+void set_threaded_mode(bool threaded);
+
+/*
+ * Enable/disable time limits of risky operations on the calling thread.
+ * Threads other than the main one must run without them.
+ */
+void set_alarm_mode(bool enable);
+
 /* Return whether any errors have occurred since last time checked */
 bool error_check();
 
@@ -0,0 +1,42 @@
+/* Log-linear latency histogram */
+
+#include <math.h>
+#include <string.h>
+
+#include "histogram.h"
+
+void hist_init(histogram_t *h)
+{
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+/* Highest value that falls into bucket i */
+static uint64_t hist_highest(unsigned i)
+{
+    if (i < HIST_SUB)
+        return i;
+    unsigned shift = (i >> HIST_SUB_BITS) - 1;
+    uint64_t lowest = (uint64_t) ((i & (HIST_SUB - 1)) + HIST_SUB) << shift;
+    return lowest + ((uint64_t) 1 << shift) - 1;
+}
+
+uint64_t hist_percentile(const histogram_t *h, double p)
+{
+    if (!h->total)
+        return 0;
+
+    uint64_t rank = (uint64_t) ceil(p / 100.0 * h->total);
+    if (rank < 1)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t v = hist_highest(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
@@ -0,0 +1,56 @@
+#ifndef LAB0_HISTOGRAM_H
+#define LAB0_HISTOGRAM_H
+
+#include <stdint.h>
+
+/* Log-linear latency histogram in the spirit of HdrHistogram.
+ *
+ * Values below 2^HIST_SUB_BITS get a bucket each.  Every larger power of two
+ * range is split into 2^HIST_SUB_BITS equal buckets, so any recorded value is
+ * known within a relative error of 2^-HIST_SUB_BITS (about 3%).  Recording is
+ * a count-leading-zeros, a shift and an increment.
+ */
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+
+/* Largest value tracked exactly is about 2^HIST_MAX_BITS, larger ones are
+ * clamped into the last bucket.  In nanoseconds this is roughly 18 minutes.
+ */
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    uint64_t total;
+    uint64_t min, max;
+    uint64_t counts[HIST_BUCKETS];
+} histogram_t;
+
+void hist_init(histogram_t *h);
+
+static inline unsigned hist_index(uint64_t v)
+{
+    if (v < HIST_SUB)
+        return v;
+    if (v >> HIST_MAX_BITS)
+        return HIST_BUCKETS - 1;
+    unsigned shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (unsigned) (v >> shift) - HIST_SUB;
+}
+
+static inline void hist_record(histogram_t *h, uint64_t v)
+{
+    h->counts[hist_index(v)]++;
+    h->total++;
+    if (v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+}
+
+/* Value at percentile p (0-100), reported as the highest value which is
+ * equivalent to the matching bucket, and never above the recorded maximum.
+ */
+uint64_t hist_percentile(const histogram_t *h, double p);
+
+#endif /* LAB0_HISTOGRAM_H */
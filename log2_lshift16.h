@@ -1,282 +1,81 @@
 /*
- * Generate precalculated values of log2 with assumption that arg will be left
- * shifted by 16 bit and return value of log2_lshift16() will be left shifted
- * by 3 bit All that shifts used for avoid of using floating point in
- * calculation.
+ * Precalculated values of log2 with assumption that arg will be left shifted
+ * by 16 bit and return value of log2_lshift16() will be left shifted by 3 bit
+ * All that shifts used for avoid of using floating point in calculation.
  */
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define LOG2_ARG_SHIFT (1 << 16)
 #define LOG2_RET_SHIFT (1 << 3)
 
-/* store precalculated function (log2(arg << 24)) << 3 */
+/* Arguments are split into ranges by their leading bit and the 4 bits after
+ * it, or by their value below 32.  The result changes at most once within a
+ * range: it is log2_base[i], plus one from log2_step[i] on.
+ */
+#define LOG2_RANGES 209
+
+static const int16_t log2_base[LOG2_RANGES] = {
+    -136, -123, -117, -113, -110, -108, -106, -104, -103, -102, -100, -99, -98,
+    -97, -97, -96, -95, -94, -94, -93, -93, -92, -92, -91, -91, -90, -90, -89,
+    -89, -88, -88, -88, -87, -87, -86, -85, -85, -84, -84, -83, -83, -82, -82,
+    -81, -81, -81, -80, -80, -79, -79, -78, -77, -77, -76, -76, -75, -75, -74,
+    -74, -73, -73, -73, -72, -72, -71, -71, -70, -69, -69, -68, -68, -67, -67,
+    -66, -66, -65, -65, -65, -64, -64, -63, -63, -62, -61, -61, -60, -60, -59,
+    -59, -58, -58, -57, -57, -57, -56, -56, -55, -55, -54, -54, -53, -52, -52,
+    -51, -51, -50, -50, -49, -49, -49, -48, -48, -47, -47, -46, -46, -45, -44,
+    -44, -43, -43, -42, -42, -41, -41, -41, -40, -40, -39, -39, -38, -38, -37,
+    -36, -36, -35, -35, -34, -34, -33, -33, -33, -32, -32, -31, -31, -30, -30,
+    -29, -28, -28, -27, -27, -26, -26, -25, -25, -25, -24, -24, -23, -23, -22,
+    -22, -21, -20, -20, -19, -19, -18, -18, -17, -17, -17, -16, -16, -15, -15,
+    -14, -14, -13, -12, -12, -11, -11, -10, -10, -9, -9, -9, -8, -8, -7, -7,
+    -6, -6, -5, -4, -4, -3, -3, -2, -2, -1, -1, -1, 0, 0, 0
+};
+
+static const uint32_t log2_step[LOG2_RANGES] = {
+    UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX,
+    UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX,
+    UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX,
+    UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX,
+    UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX, UINT32_MAX,
+    UINT32_MAX, UINT32_MAX, UINT32_MAX, 35, UINT32_MAX, UINT32_MAX, 41,
+    UINT32_MAX, 45, UINT32_MAX, 49, UINT32_MAX, UINT32_MAX, UINT32_MAX,
+    UINT32_MAX, 59, UINT32_MAX, UINT32_MAX, UINT32_MAX, 70, UINT32_MAX,
+    UINT32_MAX, 83, UINT32_MAX, 91, UINT32_MAX, 99, UINT32_MAX, UINT32_MAX,
+    UINT32_MAX, UINT32_MAX, 117, UINT32_MAX, UINT32_MAX, UINT32_MAX, 140,
+    UINT32_MAX, UINT32_MAX, 166, UINT32_MAX, 181, UINT32_MAX, 197, UINT32_MAX,
+    215, UINT32_MAX, UINT32_MAX, 235, UINT32_MAX, UINT32_MAX, UINT32_MAX, 279,
+    UINT32_MAX, UINT32_MAX, 332, UINT32_MAX, 362, UINT32_MAX, 395, UINT32_MAX,
+    431, UINT32_MAX, UINT32_MAX, 470, UINT32_MAX, UINT32_MAX, UINT32_MAX, 558,
+    UINT32_MAX, 609, 664, UINT32_MAX, 724, UINT32_MAX, 790, UINT32_MAX, 861,
+    UINT32_MAX, UINT32_MAX, 939, UINT32_MAX, UINT32_MAX, UINT32_MAX, 1117,
+    UINT32_MAX, 1218, 1328, UINT32_MAX, 1448, UINT32_MAX, 1579, UINT32_MAX,
+    1722, UINT32_MAX, UINT32_MAX, 1878, UINT32_MAX, UINT32_MAX, UINT32_MAX,
+    2233, UINT32_MAX, 2435, 2656, UINT32_MAX, 2896, UINT32_MAX, 3158,
+    UINT32_MAX, 3444, UINT32_MAX, UINT32_MAX, 3756, UINT32_MAX, UINT32_MAX,
+    UINT32_MAX, 4467, UINT32_MAX, 4871, 5312, UINT32_MAX, 5793, UINT32_MAX,
+    6317, UINT32_MAX, 6889, UINT32_MAX, UINT32_MAX, 7512, UINT32_MAX,
+    UINT32_MAX, UINT32_MAX, 8933, UINT32_MAX, 9742, 10624, UINT32_MAX, 11585,
+    UINT32_MAX, 12634, UINT32_MAX, 13777, UINT32_MAX, UINT32_MAX, 15024,
+    UINT32_MAX, UINT32_MAX, UINT32_MAX, 17867, UINT32_MAX, 19484, 21247,
+    UINT32_MAX, 23170, UINT32_MAX, 25268, UINT32_MAX, 27554, UINT32_MAX,
+    UINT32_MAX, 30048, UINT32_MAX, UINT32_MAX, UINT32_MAX, 35734, UINT32_MAX,
+    38968, 42495, UINT32_MAX, 46341, UINT32_MAX, 50535, UINT32_MAX, 55109,
+    UINT32_MAX, UINT32_MAX, 60097, UINT32_MAX, UINT32_MAX, UINT32_MAX
+};
+
+/* store precalculated function (log2(arg << 24)) << 3
+ *
+ * Two table lookups and no branches to mispredict.
+ */
 static inline int log2_lshift16(uint64_t lshift16)
 {
-    if (lshift16 < 558) {
-        if (lshift16 < 54) {
-            if (lshift16 < 13) {
-                if (lshift16 < 7) {
-                    if (lshift16 < 1)
-                        return -136;
-                    if (lshift16 < 2)
-                        return -123;
-                    if (lshift16 < 3)
-                        return -117;
-                    if (lshift16 < 4)
-                        return -113;
-                    if (lshift16 < 5)
-                        return -110;
-                    if (lshift16 < 6)
-                        return -108;
-                    if (lshift16 < 7)
-                        return -106;
-                } else {
-                    if (lshift16 < 8)
-                        return -104;
-                    if (lshift16 < 9)
-                        return -103;
-                    if (lshift16 < 10)
-                        return -102;
-                    if (lshift16 < 11)
-                        return -100;
-                    if (lshift16 < 12)
-                        return -99;
-                    if (lshift16 < 13)
-                        return -98;
-                }
-            } else {
-                if (lshift16 < 29) {
-                    if (lshift16 < 15)
-                        return -97;
-                    if (lshift16 < 16)
-                        return -96;
-                    if (lshift16 < 17)
-                        return -95;
-                    if (lshift16 < 19)
-                        return -94;
-                    if (lshift16 < 21)
-                        return -93;
-                    if (lshift16 < 23)
-                        return -92;
-                    if (lshift16 < 25)
-                        return -91;
-                    if (lshift16 < 27)
-                        return -90;
-                    if (lshift16 < 29)
-                        return -89;
-                } else {
-                    if (lshift16 < 32)
-                        return -88;
-                    if (lshift16 < 35)
-                        return -87;
-                    if (lshift16 < 38)
-                        return -86;
-                    if (lshift16 < 41)
-                        return -85;
-                    if (lshift16 < 45)
-                        return -84;
-                    if (lshift16 < 49)
-                        return -83;
-                    if (lshift16 < 54)
-                        return -82;
-                }
-            }
-        } else {
-            if (lshift16 < 181) {
-                if (lshift16 < 99) {
-                    if (lshift16 < 59)
-                        return -81;
-                    if (lshift16 < 64)
-                        return -80;
-                    if (lshift16 < 70)
-                        return -79;
-                    if (lshift16 < 76)
-                        return -78;
-                    if (lshift16 < 83)
-                        return -77;
-                    if (lshift16 < 91)
-                        return -76;
-                    if (lshift16 < 99)
-                        return -75;
-                } else {
-                    if (lshift16 < 108)
-                        return -74;
-                    if (lshift16 < 117)
-                        return -73;
-                    if (lshift16 < 128)
-                        return -72;
-                    if (lshift16 < 140)
-                        return -71;
-                    if (lshift16 < 152)
-                        return -70;
-                    if (lshift16 < 166)
-                        return -69;
-                    if (lshift16 < 181)
-                        return -68;
-                }
-            } else {
-                if (lshift16 < 304) {
-                    if (lshift16 < 197)
-                        return -67;
-                    if (lshift16 < 215)
-                        return -66;
-                    if (lshift16 < 235)
-                        return -65;
-                    if (lshift16 < 256)
-                        return -64;
-                    if (lshift16 < 279)
-                        return -63;
-                    if (lshift16 < 304)
-                        return -62;
-                } else {
-                    if (lshift16 < 332)
-                        return -61;
-                    if (lshift16 < 362)
-                        return -60;
-                    if (lshift16 < 395)
-                        return -59;
-                    if (lshift16 < 431)
-                        return -58;
-                    if (lshift16 < 470)
-                        return -57;
-                    if (lshift16 < 512)
-                        return -56;
-                    if (lshift16 < 558)
-                        return -55;
-                }
-            }
-        }
-    } else {
-        if (lshift16 < 6317) {
-            if (lshift16 < 2048) {
-                if (lshift16 < 1117) {
-                    if (lshift16 < 609)
-                        return -54;
-                    if (lshift16 < 664)
-                        return -53;
-                    if (lshift16 < 724)
-                        return -52;
-                    if (lshift16 < 790)
-                        return -51;
-                    if (lshift16 < 861)
-                        return -50;
-                    if (lshift16 < 939)
-                        return -49;
-                    if (lshift16 < 1024)
-                        return -48;
-                    if (lshift16 < 1117)
-                        return -47;
-                } else {
-                    if (lshift16 < 1218)
-                        return -46;
-                    if (lshift16 < 1328)
-                        return -45;
-                    if (lshift16 < 1448)
-                        return -44;
-                    if (lshift16 < 1579)
-                        return -43;
-                    if (lshift16 < 1722)
-                        return -42;
-                    if (lshift16 < 1878)
-                        return -41;
-                    if (lshift16 < 2048)
-                        return -40;
-                }
-            } else {
-                if (lshift16 < 3756) {
-                    if (lshift16 < 2233)
-                        return -39;
-                    if (lshift16 < 2435)
-                        return -38;
-                    if (lshift16 < 2656)
-                        return -37;
-                    if (lshift16 < 2896)
-                        return -36;
-                    if (lshift16 < 3158)
-                        return -35;
-                    if (lshift16 < 3444)
-                        return -34;
-                    if (lshift16 < 3756)
-                        return -33;
-                } else {
-                    if (lshift16 < 4096)
-                        return -32;
-                    if (lshift16 < 4467)
-                        return -31;
-                    if (lshift16 < 4871)
-                        return -30;
-                    if (lshift16 < 5312)
-                        return -29;
-                    if (lshift16 < 5793)
-                        return -28;
-                    if (lshift16 < 6317)
-                        return -27;
-                }
-            }
-        } else {
-            if (lshift16 < 21247) {
-                if (lshift16 < 11585) {
-                    if (lshift16 < 6889)
-                        return -26;
-                    if (lshift16 < 7512)
-                        return -25;
-                    if (lshift16 < 8192)
-                        return -24;
-                    if (lshift16 < 8933)
-                        return -23;
-                    if (lshift16 < 9742)
-                        return -22;
-                    if (lshift16 < 10624)
-                        return -21;
-                    if (lshift16 < 11585)
-                        return -20;
-                } else {
-                    if (lshift16 < 12634)
-                        return -19;
-                    if (lshift16 < 13777)
-                        return -18;
-                    if (lshift16 < 15024)
-                        return -17;
-                    if (lshift16 < 16384)
-                        return -16;
-                    if (lshift16 < 17867)
-                        return -15;
-                    if (lshift16 < 19484)
-                        return -14;
-                    if (lshift16 < 21247)
-                        return -13;
-                }
-            } else {
-                if (lshift16 < 35734) {
-                    if (lshift16 < 23170)
-                        return -12;
-                    if (lshift16 < 25268)
-                        return -11;
-                    if (lshift16 < 27554)
-                        return -10;
-                    if (lshift16 < 30048)
-                        return -9;
-                    if (lshift16 < 32768)
-                        return -8;
-                    if (lshift16 < 35734)
-                        return -7;
-                } else {
-                    if (lshift16 < 38968)
-                        return -6;
-                    if (lshift16 < 42495)
-                        return -5;
-                    if (lshift16 < 46341)
-                        return -4;
-                    if (lshift16 < 50535)
-                        return -3;
-                    if (lshift16 < 55109)
-                        return -2;
-                    if (lshift16 < 60097)
-                        return -1;
-                }
-            }
-        }
-    }
-    return 0;
+    /* log2 of arguments from LOG2_ARG_SHIFT on rounds to 0 */
+    if (lshift16 > LOG2_ARG_SHIFT)
+        lshift16 = LOG2_ARG_SHIFT;
+    /* Bits below the leading one and the 4 after it, none below 32 */
+    int shift = 59 - __builtin_clzll(lshift16 | 16);
+    size_t i = ((size_t) shift << 4) + (lshift16 >> shift);
+    return log2_base[i] + (lshift16 >= log2_step[i]);
 }
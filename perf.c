@@ -0,0 +1,166 @@
+/* Hardware performance counters for command instrumentation */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "perf.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+static const char *perf_names[N_PERF] = {
+#define _(x, name) name,
+    PERF_COUNTERS
+#undef _
+};
+
+/* File descriptors of each counter, -1 when not available */
+static int perf_fd[N_PERF] = {-1, -1, -1, -1};
+
+/* Position of each counter within the group read buffer */
+static int perf_slot[N_PERF];
+static int perf_nr = 0;
+static int perf_leader = -1;
+
+const char *perf_name(int counter)
+{
+    return counter >= 0 && counter < N_PERF ? perf_names[counter] : "unknown";
+}
+
+bool perf_is_open(void)
+{
+    return perf_leader >= 0;
+}
+
+#if defined(__linux__)
+static const uint64_t perf_config[N_PERF] = {
+    [PERF(cycles)] = PERF_COUNT_HW_CPU_CYCLES,
+    [PERF(instructions)] = PERF_COUNT_HW_INSTRUCTIONS,
+    [PERF(cache_misses)] = PERF_COUNT_HW_CACHE_MISSES,
+    [PERF(branch_misses)] = PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+static int perf_event_open(struct perf_event_attr *attr, int group_fd)
+{
+    /* Measure the calling thread on any CPU */
+    return syscall(SYS_perf_event_open, attr, 0, -1, group_fd, 0);
+}
+
+bool perf_open(void)
+{
+    if (perf_is_open())
+        return true;
+
+    perf_nr = 0;
+    for (int i = 0; i < N_PERF; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = perf_config[i];
+        attr.read_format = PERF_FORMAT_GROUP |
+                           PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        /* perf_event_paranoid <= 2 only permits user space counting */
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        /* Only the group leader starts disabled, members follow it */
+        attr.disabled = perf_leader < 0;
+
+        int group_fd = perf_leader < 0 ? -1 : perf_fd[perf_leader];
+        perf_fd[i] = perf_event_open(&attr, group_fd);
+        if (perf_fd[i] < 0)
+            continue;
+
+        if (perf_leader < 0)
+            perf_leader = i;
+        perf_slot[i] = perf_nr++;
+    }
+
+    if (!perf_is_open())
+        return false;
+
+    int leader = perf_fd[perf_leader];
+    ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+}
+
+bool perf_read(perf_sample_t *s)
+{
+    /* nr, time_enabled, time_running, then one value per counter */
+    uint64_t buf[3 + N_PERF];
+
+    memset(s, 0, sizeof(*s));
+    if (!perf_is_open())
+        return false;
+
+    ssize_t len = read(perf_fd[perf_leader], buf, sizeof(buf));
+    if (len < (ssize_t) (3 * sizeof(uint64_t)) || buf[0] != perf_nr)
+        return false;
+
+    /* Scaling is left to perf_delta(), as the share of time the counters
+     * ran since they were opened says little about a single command
+     */
+    s->enabled = buf[1];
+    s->running = buf[2];
+    for (int i = 0; i < N_PERF; i++) {
+        if (perf_fd[i] < 0)
+            continue;
+        s->val[i] = buf[3 + perf_slot[i]];
+        s->valid |= 1U << i;
+    }
+    return true;
+}
+#else  /* !__linux__ */
+bool perf_open(void)
+{
+    return false;
+}
+
+bool perf_read(perf_sample_t *s)
+{
+    memset(s, 0, sizeof(*s));
+    return false;
+}
+#endif
+
+void perf_close(void)
+{
+    for (int i = 0; i < N_PERF; i++) {
+        if (perf_fd[i] >= 0)
+            close(perf_fd[i]);
+        perf_fd[i] = -1;
+    }
+    perf_leader = -1;
+    perf_nr = 0;
+}
+
+void perf_delta(perf_sample_t *d,
+                const perf_sample_t *before,
+                const perf_sample_t *after)
+{
+    d->valid = before->valid & after->valid;
+    d->enabled = after->enabled - before->enabled;
+    d->running = after->running - before->running;
+
+    /* The PMU was multiplexed in between, extrapolate to the whole time.
+     * Counters which never got to run have nothing to report.
+     */
+    double scale = 1.0;
+    if (d->running < d->enabled) {
+        if (!d->running)
+            d->valid = 0;
+        else
+            scale = (double) d->enabled / d->running;
+    }
+    for (int i = 0; i < N_PERF; i++) {
+        uint64_t raw = after->val[i] - before->val[i];
+        d->val[i] = scale == 1.0 ? raw : (uint64_t) (raw * scale);
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef LAB0_PERF_H
+#define LAB0_PERF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Hardware performance counters sampled around command execution.
+ * Only available on Linux via perf_event_open(2); elsewhere perf_open()
+ * always fails and the counters simply stay disabled.
+ */
+
+#define PERF_COUNTERS               \
+    _(cycles, "cycles")             \
+    _(instructions, "instructions") \
+    _(cache_misses, "cache-misses") \
+    _(branch_misses, "branch-misses")
+
+#define PERF(x) PERF_##x
+
+enum {
+#define _(x, name) PERF(x),
+    PERF_COUNTERS
+#undef _
+    N_PERF,
+};
+
+typedef struct {
+    uint64_t val[N_PERF];
+    /* Nanoseconds the group was enabled and actually counting.  They only
+     * differ when the kernel multiplexed the counters.
+     */
+    uint64_t enabled, running;
+    /* Bitmask of counters which could be opened */
+    unsigned valid;
+} perf_sample_t;
+
+/* Open the counter group.  Return false if no counter is available */
+bool perf_open(void);
+
+/* Release all counters */
+void perf_close(void);
+
+/* Return whether counters are currently opened */
+bool perf_is_open(void);
+
+/* Read current raw counter values */
+bool perf_read(perf_sample_t *s);
+
+/* Compute per-counter difference between two samples, scaled by the share
+ * of the time in between the counters were running
+ */
+void perf_delta(perf_sample_t *d,
+                const perf_sample_t *before,
+                const perf_sample_t *after);
+
+/* Human readable name of counter */
+const char *perf_name(int counter);
+
+#endif /* LAB0_PERF_H */
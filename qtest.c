@@ -3,6 +3,8 @@
 #include <assert.h>
 #include <errno.h>
 #include <getopt.h>
+#include <math.h>
+#include <pthread.h>
 #include <signal.h>
 #include <spawn.h>
 #include <stdio.h>
@@ -19,6 +21,11 @@
 #include <time.h>
 #endif
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "dudect/cpucycles.h"
 #include "dudect/fixture.h"
 #include "list.h"
 #include "random.h"
@@ -65,21 +72,54 @@ typedef struct {
     int size;
 } queue_chain_t;
 
+/* Entropy of the strings of a queue, keyed by their address.  Open
+ * addressing with linear probing over a power of two slots.
+ */
+typedef struct {
+    const char *key;
+    double h;
+} entropy_slot_t;
+
+typedef struct {
+    entropy_slot_t *slot;
+    size_t mask;  /* Number of slots minus one */
+    size_t count; /* Strings in the map */
+    double sum;   /* Sum of their entropy */
+} entropy_map_t;
+
+/* Queue context along with the lock serializing commands run on it by
+ * worker threads.  The context comes first, so it is freed like a bare one.
+ */
+typedef struct {
+    queue_contex_t ctx;
+    pthread_mutex_t lock;
+    entropy_map_t entropy;
+    bool entropy_stale; /* Whether the queue freed strings still mapped */
+} locked_contex_t;
+
 static queue_chain_t chain = {.size = 0};
-static queue_contex_t *current = NULL;
+
+/* Each worker thread operates on a queue of its own */
+static __thread queue_contex_t *current = NULL;
 
 /* How many times can queue operations fail */
 static int fail_limit = BIG_LIST_SIZE;
-static int fail_count = 0;
+static _Atomic int fail_count = 0;
 
 static int string_length = MAXSTRING;
 
+/* Whether removed elements are checked to be allocated blocks when they
+ * are released, which takes time linear in the number of blocks
+ */
+static int cautious_remove = 1;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
 
 /* Forward declarations */
 static bool q_show(int vlevel);
+static void entropy_clear(entropy_map_t *m);
 
 static bool do_free(int argc, char *argv[])
 {
@@ -116,6 +156,7 @@ static bool do_free(int argc, char *argv[])
     }
 
     if (current) {
+        entropy_clear(&((locked_contex_t *) current)->entropy);
         free(current);
         chain.size--;
         current = qnext ? list_entry(qnext, queue_contex_t, chain) : NULL;
@@ -143,7 +184,11 @@ static bool do_new(int argc, char *argv[])
     bool ok = true;
 
     if (exception_setup(true)) {
-        queue_contex_t *qctx = malloc(sizeof(queue_contex_t));
+        locked_contex_t *lctx = malloc(sizeof(locked_contex_t));
+        pthread_mutex_init(&lctx->lock, NULL);
+        memset(&lctx->entropy, 0, sizeof(entropy_map_t));
+        lctx->entropy_stale = false;
+        queue_contex_t *qctx = &lctx->ctx;
         list_add_tail(&qctx->chain, &chain.head);
 
         qctx->size = 0;
@@ -158,19 +203,246 @@ static bool do_new(int argc, char *argv[])
     return ok && !error_check();
 }
 
-/* TODO: Add a buf_size check of if the buf_size may be less
- * than MIN_RANDSTR_LEN.
+/* Strings for RAND are made RANDSTR_BATCH at a time from a single request
+ * for random bytes.  Bytes are mapped onto the charset by multiplying and
+ * shifting rather than by a modulo, which SSE2 does 16 bytes at a time.
  */
-static void fill_rand_string(char *buf, size_t buf_size)
+#define RANDSTR_BATCH 256
+
+typedef struct {
+    char str[RANDSTR_BATCH][MAX_RANDSTR_LEN];
+    int next;
+} randstr_batch_t;
+
+#define RANDSTR_BATCH_INIT {.next = RANDSTR_BATCH}
+
+/* Map n random bytes onto the charset */
+static void map_charset(uint8_t *p, size_t n)
 {
-    size_t len = 0;
-    while (len < MIN_RANDSTR_LEN)
-        len = rand() % buf_size;
+    const size_t letters = sizeof(charset) - 1;
+    size_t i = 0;
+#if defined(__SSE2__)
+    /* The charset is a contiguous range, so each byte b becomes
+     * 'a' + (b * letters >> 8), the high half of b * (letters << 8).
+     */
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i scale = _mm_set1_epi16(letters << 8);
+    const __m128i base = _mm_set1_epi8(charset[0]);
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+        __m128i lo = _mm_mulhi_epu16(_mm_unpacklo_epi8(v, zero), scale);
+        __m128i hi = _mm_mulhi_epu16(_mm_unpackhi_epi8(v, zero), scale);
+        v = _mm_add_epi8(_mm_packus_epi16(lo, hi), base);
+        _mm_storeu_si128((__m128i *) (p + i), v);
+    }
+#endif
+    for (; i < n; i++)
+        p[i] = charset[p[i] * letters >> 8];
+}
+
+static void fill_rand_strings(randstr_batch_t *b)
+{
+    uint8_t *p = (uint8_t *) b->str;
+    uint8_t len[RANDSTR_BATCH];
+
+    randombytes(p, sizeof(b->str));
+    /* The last byte of each string is always a terminator, so it is free
+     * to pick a length from MIN_RANDSTR_LEN to MAX_RANDSTR_LEN - 1.
+     */
+    for (int i = 0; i < RANDSTR_BATCH; i++) {
+        uint8_t r = b->str[i][MAX_RANDSTR_LEN - 1];
+        len[i] =
+            MIN_RANDSTR_LEN + (r * (MAX_RANDSTR_LEN - MIN_RANDSTR_LEN) >> 8);
+    }
+    map_charset(p, sizeof(b->str));
+    for (int i = 0; i < RANDSTR_BATCH; i++)
+        b->str[i][len[i]] = '\0';
+    b->next = 0;
+}
+
+static char *next_rand_string(randstr_batch_t *b)
+{
+    if (b->next == RANDSTR_BATCH)
+        fill_rand_strings(b);
+    return b->str[b->next++];
+}
 
-    randombytes((uint8_t *) buf, len);
-    for (size_t n = 0; n < len; n++)
-        buf[n] = charset[buf[n] % (sizeof(charset) - 1)];
-    buf[len] = '\0';
+static size_t entropy_hash(const entropy_map_t *m, const char *key)
+{
+    return ((uint64_t) (uintptr_t) key * 0x9E3779B97F4A7C15ULL >> 32) &
+           m->mask;
+}
+
+/* Slot holding key, or the empty slot where it would go */
+static entropy_slot_t *entropy_find(const entropy_map_t *m, const char *key)
+{
+    size_t i = entropy_hash(m, key);
+    while (m->slot[i].key && m->slot[i].key != key)
+        i = (i + 1) & m->mask;
+    return &m->slot[i];
+}
+
+/* Double the slots.  Return false if they could not be allocated. */
+static bool entropy_grow(entropy_map_t *m)
+{
+    entropy_slot_t *old = m->slot;
+    size_t old_cap = old ? m->mask + 1 : 0;
+    size_t cap = old ? old_cap * 2 : 64;
+    entropy_slot_t *slot = calloc(cap, sizeof(entropy_slot_t));
+    if (!slot)
+        return false;
+
+    m->slot = slot;
+    m->mask = cap - 1;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].key)
+            *entropy_find(m, old[i].key) = old[i];
+    }
+    free(old);
+    return true;
+}
+
+/* Map key to h.  Strings left out for lack of memory only get computed
+ * again, as queue_entropy() goes through the queue whenever some are.
+ */
+static void entropy_put(entropy_map_t *m, const char *key, double h)
+{
+    /* Keep the load below 3/4 */
+    if ((!m->slot || (m->count + 1) * 4 > (m->mask + 1) * 3) &&
+        !entropy_grow(m))
+        return;
+    entropy_slot_t *s = entropy_find(m, key);
+    if (s->key) {
+        m->sum -= s->h;
+    } else {
+        s->key = key;
+        m->count++;
+    }
+    s->h = h;
+    m->sum += h;
+}
+
+static bool entropy_get(const entropy_map_t *m, const char *key, double *h)
+{
+    if (!m->slot)
+        return false;
+    entropy_slot_t *s = entropy_find(m, key);
+    if (!s->key)
+        return false;
+    *h = s->h;
+    return true;
+}
+
+static void entropy_del(entropy_map_t *m, const char *key)
+{
+    if (!m->slot)
+        return;
+    entropy_slot_t *s = entropy_find(m, key);
+    if (!s->key)
+        return;
+    m->sum -= s->h;
+    if (!--m->count)
+        m->sum = 0;
+
+    /* Move back the entries after the hole which may not stay past it */
+    size_t i = s - m->slot;
+    for (size_t j = (i + 1) & m->mask; m->slot[j].key;
+         j = (j + 1) & m->mask) {
+        size_t home = entropy_hash(m, m->slot[j].key);
+        if (((j - home) & m->mask) >= ((j - i) & m->mask)) {
+            m->slot[i] = m->slot[j];
+            i = j;
+        }
+    }
+    m->slot[i].key = NULL;
+}
+
+static void entropy_clear(entropy_map_t *m)
+{
+    free(m->slot);
+    memset(m, 0, sizeof(entropy_map_t));
+}
+
+/* Entropy of a string in the current queue, computed once and then kept */
+static double element_entropy(char *value)
+{
+    entropy_map_t *m = &((locked_contex_t *) current)->entropy;
+    double h;
+    if (!entropy_get(m, value, &h)) {
+        h = shannon_entropy((const uint8_t *) value);
+        entropy_put(m, value, h);
+    }
+    return h;
+}
+
+/* Map value, just inserted into the current queue, while entropy is shown.
+ * Otherwise drop what its address may still map to from a freed string, and
+ * leave it for queue_entropy() to compute.
+ */
+static void entropy_insert(char *value)
+{
+    entropy_map_t *m = &((locked_contex_t *) current)->entropy;
+    if (show_entropy)
+        entropy_put(m, value, shannon_entropy((const uint8_t *) value));
+    else
+        entropy_del(m, value);
+}
+
+/* Rebuild the map of qctx from the strings it holds, dropping those it
+ * freed.  With fill set, also compute the entropy of unmapped strings.
+ */
+static void entropy_sync(queue_contex_t *qctx, bool fill)
+{
+    locked_contex_t *lctx = (locked_contex_t *) qctx;
+    entropy_map_t old = lctx->entropy;
+    memset(&lctx->entropy, 0, sizeof(entropy_map_t));
+
+    element_t *e;
+    list_for_each_entry (e, qctx->q, list) {
+        double h;
+        if (entropy_get(&old, e->value, &h))
+            entropy_put(&lctx->entropy, e->value, h);
+        else if (fill)
+            entropy_put(&lctx->entropy, e->value,
+                        shannon_entropy((const uint8_t *) e->value));
+    }
+    entropy_clear(&old);
+    lctx->entropy_stale = false;
+}
+
+/* Note that the current queue freed strings on its own, which its map may
+ * still hold
+ */
+static void entropy_freed(void)
+{
+    if (current)
+        ((locked_contex_t *) current)->entropy_stale = true;
+}
+
+/* Mean entropy of the strings in the current queue */
+static double queue_entropy(void)
+{
+    locked_contex_t *lctx = (locked_contex_t *) current;
+    if (lctx->entropy_stale || lctx->entropy.count != (size_t) current->size)
+        entropy_sync(current, true);
+    return current->size ? lctx->entropy.sum / current->size : 0;
+}
+
+/* Check in simulation mode that an operation takes time linear in the size
+ * of the queue
+ */
+static bool simulate_linear(bool (*is_linear)(void), int argc, char *argv[])
+{
+    if (argc != 1) {
+        report(1, "%s does not need arguments in simulation mode", argv[0]);
+        return false;
+    }
+    if (!is_linear()) {
+        report(1, "ERROR: Probably not linear time or wrong implementation");
+        return false;
+    }
+    report(1, "Probably linear time");
+    return true;
 }
 
 /* insert head */
@@ -192,7 +464,7 @@ static bool do_ih(int argc, char *argv[])
     }
 
     char *lasts = NULL;
-    char randstr_buf[MAX_RANDSTR_LEN];
+    randstr_batch_t randstr = RANDSTR_BATCH_INIT;
     int reps = 1;
     bool ok = true, need_rand = false;
     if (argc != 2 && argc != 3) {
@@ -210,17 +482,17 @@ static bool do_ih(int argc, char *argv[])
 
     if (!strcmp(inserts, "RAND")) {
         need_rand = true;
-        inserts = randstr_buf;
     }
 
     if (!current || !current->q)
         report(3, "Warning: Calling insert head on null queue");
     error_check();
+    set_cmd_ops(reps);
 
     if (current && exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
-                fill_rand_string(randstr_buf, sizeof(randstr_buf));
+                inserts = next_rand_string(&randstr);
             bool rval = q_insert_head(current->q, inserts);
             if (rval) {
                 current->size++;
@@ -242,6 +514,7 @@ static bool do_ih(int argc, char *argv[])
                     ok = false;
                     break;
                 }
+                entropy_insert(cur_inserts);
                 lasts = cur_inserts;
             } else {
                 fail_count++;
@@ -281,7 +554,7 @@ static bool do_it(int argc, char *argv[])
         return ok;
     }
 
-    char randstr_buf[MAX_RANDSTR_LEN];
+    randstr_batch_t randstr = RANDSTR_BATCH_INIT;
     int reps = 1;
     bool ok = true, need_rand = false;
     if (argc != 2 && argc != 3) {
@@ -299,17 +572,17 @@ static bool do_it(int argc, char *argv[])
 
     if (!strcmp(inserts, "RAND")) {
         need_rand = true;
-        inserts = randstr_buf;
     }
 
     if (!current || !current->q)
         report(3, "Warning: Calling insert tail on null queue");
     error_check();
+    set_cmd_ops(reps);
 
     if (current && exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
             if (need_rand)
-                fill_rand_string(randstr_buf, sizeof(randstr_buf));
+                inserts = next_rand_string(&randstr);
             bool rval = q_insert_tail(current->q, inserts);
             if (rval) {
                 current->size++;
@@ -318,6 +591,8 @@ static bool do_it(int argc, char *argv[])
                 if (!cur_inserts) {
                     report(1, "ERROR: Failed to save copy of string in queue");
                     ok = false;
+                } else {
+                    entropy_insert(cur_inserts);
                 }
             } else {
                 fail_count++;
@@ -407,9 +682,12 @@ static bool do_remove(int option, int argc, char *argv[])
     bool is_null = re ? false : true;
 
     if (!is_null) {
+        entropy_del(&((locked_contex_t *) current)->entropy, re->value);
         // q_remove_head and q_remove_tail are not responsible for releasing
         // node
+        set_cautious_mode(cautious_remove);
         q_release_element(re);
+        set_cautious_mode(true);
 
         removes[string_length + STRINGPAD] = '\0';
         if (removes[0] == '\0') {
@@ -510,6 +788,7 @@ static bool do_dedup(int argc, char *argv[])
     if (exception_setup(true))
         ok = q_delete_dup(current->q);
     exception_cancel();
+    entropy_freed();
 
     if (!ok) {
         list_for_each_entry_safe (item, tmp, &l_copy, list) {
@@ -558,6 +837,9 @@ static bool do_dedup(int argc, char *argv[])
 
 static bool do_reverse(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate_linear(is_reverse_linear, argc, argv);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -579,6 +861,9 @@ static bool do_reverse(int argc, char *argv[])
 
 static bool do_size(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate_linear(is_size_linear, argc, argv);
+
     if (argc != 1 && argc != 2) {
         report(1, "%s takes 0-1 arguments", argv[0]);
         return false;
@@ -600,6 +885,7 @@ static bool do_size(int argc, char *argv[])
     if (!current || !current->q)
         report(3, "Warning: Calling size on null queue");
     error_check();
+    set_cmd_ops(reps);
 
     if (current && exception_setup(true)) {
         for (int r = 0; ok && r < reps; r++) {
@@ -717,6 +1003,9 @@ bool do_sort_linux(int argc, char *argv[])
 
 static bool do_dm(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate_linear(is_delete_mid_linear, argc, argv);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -730,6 +1019,7 @@ static bool do_dm(int argc, char *argv[])
     if (exception_setup(true))
         ok = q_delete_mid(current->q);
     exception_cancel();
+    entropy_freed();
 
     current->size--;
     q_show(3);
@@ -738,6 +1028,9 @@ static bool do_dm(int argc, char *argv[])
 
 static bool do_swap(int argc, char *argv[])
 {
+    if (simulation)
+        return simulate_linear(is_swap_linear, argc, argv);
+
     if (argc != 1) {
         report(1, "%s takes no arguments", argv[0]);
         return false;
@@ -778,6 +1071,7 @@ static bool do_descend(int argc, char *argv[])
     if (exception_setup(true))
         current->size = q_descend(current->q);
     set_noallocate_mode(false);
+    entropy_freed();
 
     bool ok = true;
 
@@ -843,6 +1137,16 @@ static bool do_merge(int argc, char *argv[])
     }
     error_check();
 
+    /* The maps of all the queues end up in the first one, which freed
+     * strings must not be carried into: their addresses may be in use by
+     * another queue.
+     */
+    queue_contex_t *qctx;
+    list_for_each_entry (qctx, &chain.head, chain) {
+        if (((locked_contex_t *) qctx)->entropy_stale && qctx->q)
+            entropy_sync(qctx, false);
+    }
+
     int len = 0;
     set_noallocate_mode(true);
     if (current && exception_setup(true))
@@ -854,11 +1158,18 @@ static bool do_merge(int argc, char *argv[])
         chain.size = 1;
         current = list_entry(chain.head.next, queue_contex_t, chain);
         current->size = len;
+        entropy_map_t *m = &((locked_contex_t *) current)->entropy;
 
         struct list_head *cur = chain.head.next->next;
         while ((uintptr_t) cur != (uintptr_t) &chain.head) {
             queue_contex_t *ctx = list_entry(cur, queue_contex_t, chain);
+            entropy_map_t *from = &((locked_contex_t *) ctx)->entropy;
             cur = cur->next;
+            for (size_t i = 0; from->slot && i <= from->mask; i++) {
+                if (from->slot[i].key)
+                    entropy_put(m, from->slot[i].key, from->slot[i].h);
+            }
+            entropy_clear(from);
             q_free(ctx->q);
             free(ctx);
         }
@@ -977,11 +1288,9 @@ static bool q_show(int vlevel)
             element_t *e = list_entry(cur, element_t, list);
             if (cnt < BIG_LIST_SIZE) {
                 report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
-                if (show_entropy) {
-                    report_noreturn(
-                        vlevel, "(%3.2f%%)",
-                        shannon_entropy((const uint8_t *) e->value));
-                }
+                if (show_entropy)
+                    report_noreturn(vlevel, "(%3.2f%%)",
+                                    element_entropy(e->value));
             }
             cnt++;
             cur = cur->next;
@@ -1000,6 +1309,8 @@ static bool q_show(int vlevel)
             report(vlevel, "]");
         else
             report(vlevel, " ... ]");
+        if (show_entropy)
+            report(vlevel, "Entropy %3.2f%% on average", queue_entropy());
     } else {
         report(vlevel, " ... ]");
         report(vlevel, "ERROR:  Queue has more than %d elements",
@@ -1069,6 +1380,523 @@ static bool do_next(int argc, char *argv[])
     return q_show(0);
 }
 
+/* String lengths are grouped by powers of two, the last bucket collects
+ * everything longer.
+ */
+#define FOOTPRINT_BUCKETS 12
+
+typedef struct {
+    size_t elements;
+    size_t blocks;
+    size_t payload; /* Bytes requested for heads, elements and strings */
+    size_t harness; /* Headers and footers added by test_malloc */
+    size_t system;  /* System allocator headers and rounding slack */
+    size_t string_blocks;
+    size_t string_bytes; /* Characters stored, without terminators */
+    size_t lengths[FOOTPRINT_BUCKETS];
+} footprint_t;
+
+static bool footprint_add(footprint_t *fp, void *p)
+{
+    block_info_t info;
+    if (!block_info(p, &info))
+        return false;
+
+    fp->blocks++;
+    fp->payload += info.payload;
+    fp->harness += info.harness;
+    fp->system += info.system;
+    return true;
+}
+
+static bool queue_footprint(queue_contex_t *ctx, footprint_t *fp)
+{
+    bool ok = true;
+    memset(fp, 0, sizeof(*fp));
+    if (!ctx->q)
+        return true;
+
+    footprint_add(fp, ctx->q);
+    if (exception_setup(true)) {
+        element_t *e;
+        list_for_each_entry (e, ctx->q, list) {
+            fp->elements++;
+            footprint_add(fp, e);
+            if (!e->value)
+                continue;
+            /* Strings embedded in the element are not separate blocks */
+            if (footprint_add(fp, e->value))
+                fp->string_blocks++;
+            size_t len = strlen(e->value);
+            fp->string_bytes += len;
+            int b = len ? 64 - __builtin_clzll(len) : 0;
+            fp->lengths[b < FOOTPRINT_BUCKETS ? b : FOOTPRINT_BUCKETS - 1]++;
+        }
+    } else {
+        ok = false;
+    }
+    exception_cancel();
+    return ok && !error_check();
+}
+
+static void report_footprint(queue_contex_t *ctx, const footprint_t *fp)
+{
+    size_t live = fp->payload + fp->harness + fp->system;
+    report(1, "Queue %d: %lu elements, %lu live bytes in %lu blocks", ctx->id,
+           (unsigned long) fp->elements, (unsigned long) live,
+           (unsigned long) fp->blocks);
+    if (fp->elements)
+        report(1, "  %.1f bytes per element", (double) live / fp->elements);
+    report(1, "  payload %lu, harness %lu, system allocator %lu",
+           (unsigned long) fp->payload, (unsigned long) fp->harness,
+           (unsigned long) fp->system);
+    report(1, "  strings: %lu characters, %lu separate blocks, %lu inline",
+           (unsigned long) fp->string_bytes, (unsigned long) fp->string_blocks,
+           (unsigned long) (fp->elements - fp->string_blocks));
+    if (fp->string_bytes)
+        report(1, "  overhead ratio %.2f (live bytes per string character)",
+               (double) live / fp->string_bytes);
+
+    report_noreturn(1, "  string lengths:");
+    for (int b = 0; b < FOOTPRINT_BUCKETS; b++) {
+        if (!fp->lengths[b])
+            continue;
+        if (b == 0)
+            report_noreturn(1, " 0:%lu", (unsigned long) fp->lengths[b]);
+        else if (b == FOOTPRINT_BUCKETS - 1)
+            report_noreturn(1, " %lu+:%lu", 1UL << (b - 1),
+                            (unsigned long) fp->lengths[b]);
+        else
+            report_noreturn(1, " %lu-%lu:%lu", 1UL << (b - 1), (1UL << b) - 1,
+                            (unsigned long) fp->lengths[b]);
+    }
+    report(1, "%s", fp->elements ? "" : " none");
+}
+
+static bool do_footprint(int argc, char *argv[])
+{
+    if (argc > 2 || (argc == 2 && strcmp(argv[1], "all"))) {
+        report(1, "%s takes an optional argument 'all'", argv[0]);
+        return false;
+    }
+
+    if (!current) {
+        report(3, "Warning: Try to operate null queue");
+        return true;
+    }
+
+    bool ok = true;
+    footprint_t fp;
+    if (argc == 1) {
+        ok = queue_footprint(current, &fp);
+        report_footprint(current, &fp);
+        return ok;
+    }
+
+    queue_contex_t *ctx;
+    list_for_each_entry (ctx, &chain.head, chain) {
+        ok = queue_footprint(ctx, &fp) && ok;
+        report_footprint(ctx, &fp);
+    }
+    return ok;
+}
+
+static void cycles_setter(int oldval)
+{
+    int source = cpucycles_source;
+    if (!cpucycles_set_source(source))
+        report(1, "Cycle counter %d is not available, using the time stamp "
+                  "counter", source);
+}
+
+/* Queue sizes swept by the complexity command grow by a factor of two.
+ * Beyond the caches the cost of every element access grows as well, which
+ * makes any operation look superlinear, so the default sweep stays small.
+ */
+#define COMPLEXITY_MIN_SIZE 128
+#define COMPLEXITY_MAX_SIZE (1 << 12)
+#define COMPLEXITY_STEPS 16
+/* Measurements per size, the median is kept */
+#define COMPLEXITY_REPS 15
+/* Bytes read before each measurement when the size of the L2 cache is not
+ * known, twice that size otherwise
+ */
+#define COMPLEXITY_EVICT_SIZE (4 << 20)
+
+static bool complexity_ih(struct list_head *q)
+{
+    return q_insert_head(q, "complexity");
+}
+
+static bool complexity_it(struct list_head *q)
+{
+    return q_insert_tail(q, "complexity");
+}
+
+static bool complexity_rh(struct list_head *q)
+{
+    element_t *e = q_remove_head(q, NULL, 0);
+    if (e)
+        q_release_element(e);
+    return e;
+}
+
+static bool complexity_rt(struct list_head *q)
+{
+    element_t *e = q_remove_tail(q, NULL, 0);
+    if (e)
+        q_release_element(e);
+    return e;
+}
+
+static bool complexity_size(struct list_head *q)
+{
+    return q_size(q) >= 0;
+}
+
+static bool complexity_dm(struct list_head *q)
+{
+    return q_delete_mid(q);
+}
+
+static bool complexity_swap(struct list_head *q)
+{
+    q_swap(q);
+    return true;
+}
+
+static bool complexity_reverse(struct list_head *q)
+{
+    q_reverse(q);
+    return true;
+}
+
+static bool complexity_sort(struct list_head *q)
+{
+    q_sort(q);
+    return true;
+}
+
+static bool complexity_descend(struct list_head *q)
+{
+    return q_descend(q) >= 0;
+}
+
+static const struct {
+    const char *name;
+    bool (*run)(struct list_head *q);
+} complexity_ops[] = {
+    {"ih", complexity_ih},         {"it", complexity_it},
+    {"rh", complexity_rh},         {"rt", complexity_rt},
+    {"size", complexity_size},     {"dm", complexity_dm},
+    {"swap", complexity_swap},     {"reverse", complexity_reverse},
+    {"sort", complexity_sort},     {"descend", complexity_descend},
+};
+
+static double model_1(double n)
+{
+    return 1;
+}
+
+static double model_log(double n)
+{
+    return log2(n);
+}
+
+static double model_n(double n)
+{
+    return n;
+}
+
+static double model_nlog(double n)
+{
+    return n * log2(n);
+}
+
+static double model_n2(double n)
+{
+    return n * n;
+}
+
+static const struct {
+    const char *name;
+    double (*f)(double n);
+} complexity_models[] = {
+    {"O(1)", model_1},           {"O(log n)", model_log},
+    {"O(n)", model_n},           {"O(n log n)", model_nlog},
+    {"O(n^2)", model_n2},
+};
+
+#define N_MODELS (sizeof(complexity_models) / sizeof(complexity_models[0]))
+
+/* Exponent of the growth of model f from n = lo to n = hi */
+static double model_growth(double (*f)(double), double lo, double hi)
+{
+    return log(f(hi) / f(lo)) / log(hi / lo);
+}
+
+/* Median of the cnt values in v, which get sorted.  There are few of them. */
+static double complexity_median(double *v, int cnt)
+{
+    for (int i = 1; i < cnt; i++) {
+        double x = v[i];
+        int j = i;
+        for (; j > 0 && v[j - 1] > x; j--)
+            v[j] = v[j - 1];
+        v[j] = x;
+    }
+    return cnt % 2 ? v[cnt / 2] : (v[cnt / 2 - 1] + v[cnt / 2]) / 2;
+}
+
+/* Exponent k with cycles growing as n^k, which compares the cost of every
+ * two sizes: it is the median slope between them in log space, so one
+ * disturbed size hardly moves it, and a constant cost only matters on the
+ * smallest queues.  Store in noise the standard error of k, from how far the
+ * sizes scatter around that line.
+ */
+static double complexity_growth(const double *n,
+                                const double *cycles,
+                                int steps,
+                                double *noise)
+{
+    double x[COMPLEXITY_STEPS], y[COMPLEXITY_STEPS];
+    double v[COMPLEXITY_STEPS * (COMPLEXITY_STEPS - 1) / 2];
+    int cnt = 0;
+    for (int i = 0; i < steps; i++) {
+        x[i] = log(n[i]);
+        y[i] = log(cycles[i]);
+        for (int j = 0; j < i; j++)
+            v[cnt++] = (y[i] - y[j]) / (x[i] - x[j]);
+    }
+    double k = complexity_median(v, cnt);
+
+    for (int i = 0; i < steps; i++)
+        v[i] = y[i] - k * x[i];
+    double c = complexity_median(v, steps);
+
+    double mean = 0, sxx = 0;
+    for (int i = 0; i < steps; i++) {
+        v[i] = fabs(y[i] - k * x[i] - c);
+        mean += x[i];
+    }
+    mean /= steps;
+    for (int i = 0; i < steps; i++)
+        sxx += (x[i] - mean) * (x[i] - mean);
+    /* 1.4826 times the median absolute deviation estimates the standard
+     * deviation, without letting the disturbed sizes in
+     */
+    *noise = 1.4826 * complexity_median(v, steps) / sqrt(sxx);
+    return k;
+}
+
+/* Reads of the eviction buffer end up here, so they are not optimized out */
+static volatile unsigned char complexity_sink;
+
+/* Store in cycles the cycles op takes on a queue of n elements, with the
+ * caches evicted by reading evict_size bytes at evict.  Return false if the
+ * operation failed or timed out.
+ */
+static bool complexity_run(bool (*op)(struct list_head *q),
+                           int n,
+                           randstr_batch_t *randstr,
+                           const unsigned char *evict,
+                           size_t evict_size,
+                           double *cycles)
+{
+    struct list_head *q = q_new();
+    bool ok = q;
+    for (int i = 0; ok && i < n; i++)
+        ok = q_insert_head(q, next_rand_string(randstr));
+
+    /* A queue just built stays in the caches as long as it fits, which
+     * would make small queues cheaper per element than large ones.
+     */
+    unsigned char sum = 0;
+    for (size_t i = 0; ok && i < evict_size; i += 64)
+        sum += evict[i];
+    complexity_sink = sum;
+
+    if (ok && exception_setup(true)) {
+        int64_t before = cpucycles_start();
+        ok = op(q);
+        int64_t after = cpucycles_stop();
+        *cycles = cpucycles_elapsed(before, after);
+    } else {
+        ok = false;
+    }
+    exception_cancel();
+    q_free(q);
+    return ok && !error_check();
+}
+
+static bool do_complexity(int argc, char *argv[])
+{
+    int max_size = COMPLEXITY_MAX_SIZE;
+    if (argc < 2 || argc > 3 ||
+        (argc == 3 && (!get_int(argv[2], &max_size) ||
+                       max_size < COMPLEXITY_MIN_SIZE * 4))) {
+        report(1, "Usage: %s OP [MAX_SIZE], MAX_SIZE at least %d", argv[0],
+               COMPLEXITY_MIN_SIZE * 4);
+        return false;
+    }
+
+    bool (*op)(struct list_head *q) = NULL;
+    for (size_t i = 0; i < sizeof(complexity_ops) / sizeof(complexity_ops[0]);
+         i++) {
+        if (!strcmp(argv[1], complexity_ops[i].name))
+            op = complexity_ops[i].run;
+    }
+    if (!op) {
+        report(1, "Unknown operation '%s'", argv[1]);
+        return false;
+    }
+
+    /* The queues are built here, injected malloc failures would only get in
+     * the way.  Cautious mode would make every free linear, as in do_free().
+     */
+    int saved_probability = fail_probability;
+    fail_probability = 0;
+    set_cautious_mode(false);
+    cpucycles_calibrate();
+
+    size_t evict_size = COMPLEXITY_EVICT_SIZE;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (l2 > 0)
+        evict_size = 2 * l2;
+#endif
+    /* Written once, pages never written would all read the same zeroes */
+    unsigned char *evict = malloc(evict_size);
+    if (!evict)
+        evict_size = 0;
+    else
+        memset(evict, 1, evict_size);
+
+    double n[COMPLEXITY_STEPS], cycles[COMPLEXITY_STEPS];
+    double reps[COMPLEXITY_STEPS][COMPLEXITY_REPS];
+    int steps = 0;
+    for (int size = COMPLEXITY_MIN_SIZE;
+         size <= max_size && steps < COMPLEXITY_STEPS; size *= 2)
+        n[steps++] = size;
+
+    /* Go through the sizes in turn, so whatever else slows the machine down
+     * for a while spreads over all of them instead of bending the curve
+     */
+    randstr_batch_t randstr = RANDSTR_BATCH_INIT;
+    for (int r = 0; r < COMPLEXITY_REPS; r++) {
+        for (int i = 0; i < steps; i++) {
+            if (!complexity_run(op, n[i], &randstr, evict, evict_size,
+                                &reps[i][r])) {
+                report(1, "%s failed or timed out on %.0f elements", argv[1],
+                       n[i]);
+                steps = i;
+                break;
+            }
+        }
+    }
+    free(evict);
+    fail_probability = saved_probability;
+    set_cautious_mode(true);
+
+    if (steps < 3) {
+        report(1, "ERROR: Too few sizes measured to fit a model");
+        return false;
+    }
+
+    for (int i = 0; i < steps; i++) {
+        double c = complexity_median(reps[i], COMPLEXITY_REPS);
+        /* cycles stay positive for the logarithm */
+        cycles[i] = c > 1 ? c : 1;
+        report(3, "%8.0f elements: %12.0f cycles", n[i], cycles[i]);
+    }
+
+    /* Each model grows by an exponent of its own over the sizes measured,
+     * the closest one to that of the cycles fits
+     */
+    double noise;
+    double k = complexity_growth(n, cycles, steps, &noise);
+    double dist[N_MODELS];
+    size_t best = 0, second = 1;
+    for (size_t m = 0; m < N_MODELS; m++) {
+        dist[m] = fabs(k - model_growth(complexity_models[m].f, n[0],
+                                        n[steps - 1]));
+        if (dist[m] < dist[best]) {
+            second = best;
+            best = m;
+        } else if (m != best && (second == best || dist[m] < dist[second])) {
+            second = m;
+        }
+    }
+
+    /* Within noise of each other, the slower growing model is named first */
+    if (dist[second] - dist[best] < 2 * noise) {
+        size_t lo = best < second ? best : second;
+        size_t hi = best < second ? second : best;
+        report(1, "%s fit %s or %s, ambiguous: cost grows as n^%.2f +/- %.2f",
+               argv[1], complexity_models[lo].name, complexity_models[hi].name,
+               k, noise);
+    } else {
+        report(1,
+               "%s fit %s: cost grows as n^%.2f +/- %.2f, next closest %s",
+               argv[1], complexity_models[best].name, k, noise,
+               complexity_models[second].name);
+    }
+    return true;
+}
+
+/* Commands which only touch the current queue may run concurrently */
+static bool queue_concurrent(int argc, char *argv[])
+{
+    static const char *const cmds[] = {
+        "ih", "it", "rh", "rt", "reverse", "sort", "sort_linux", "size",
+        "show", "dm", "dedup", "swap", "descend", "reverseK", "shuffle",
+    };
+
+    /* Simulation measures timing with global state */
+    if (simulation)
+        return false;
+    for (size_t i = 0; i < sizeof(cmds) / sizeof(cmds[0]); i++) {
+        if (!strcmp(argv[0], cmds[i]))
+            return true;
+    }
+    return false;
+}
+
+static void *queue_current(void)
+{
+    return current;
+}
+
+static void queue_select(void *queue)
+{
+    queue_contex_t *ctx;
+    current = NULL;
+    list_for_each_entry (ctx, &chain.head, chain) {
+        if (ctx == queue) {
+            current = ctx;
+            break;
+        }
+    }
+}
+
+static void queue_lock(bool acquire)
+{
+    if (!current)
+        return;
+    pthread_mutex_t *lock = &((locked_contex_t *) current)->lock;
+    if (acquire)
+        pthread_mutex_lock(lock);
+    else
+        pthread_mutex_unlock(lock);
+}
+
+static const parallel_ops_t queue_parallel_ops = {
+    .concurrent = queue_concurrent,
+    .current = queue_current,
+    .select = queue_select,
+    .lock = queue_lock,
+};
+
 static void console_init()
 {
     ADD_COMMAND(new, "Create new queue", "");
@@ -1097,6 +1925,13 @@ static void console_init()
                 "Sort queue in ascending order with linux list_sort.h", "");
     ADD_COMMAND(size, "Compute queue size n times (default: n == 1)", "[n]");
     ADD_COMMAND(show, "Show queue contents", "");
+    ADD_COMMAND(footprint,
+                "Show memory footprint of current queue, or of all queues",
+                "[all]");
+    ADD_COMMAND(complexity,
+                "Fit the time op takes on queues of up to max_size elements "
+                "to O(1), O(log n), O(n), O(n log n) and O(n^2)",
+                "op [max_size]");
     ADD_COMMAND(dm, "Delete middle node in queue", "");
     ADD_COMMAND(dedup, "Delete all nodes that have duplicate string", "");
     ADD_COMMAND(merge, "Merge all the queues into one sorted queue", "");
@@ -1116,6 +1951,18 @@ static void console_init()
               NULL);
     add_param("fail", &fail_limit,
               "Number of times allow queue operations to return false", NULL);
+    add_param("dudect", &dudect_workers,
+              "Processes measuring constant time, one per CPU (0: none)",
+              NULL);
+    add_param("cautious", &cautious_remove,
+              "Check removed elements were allocated, slow on big queues",
+              NULL);
+    add_param("timeout", &time_limit,
+              "Seconds a queue operation may run (0: unlimited)", NULL);
+    add_param("cycles", &cpucycles_source,
+              "Cycle counter for timing (0: time stamp counter, 1: perf)",
+              cycles_setter);
+    set_parallel_ops(&queue_parallel_ops);
 }
 
 /* Signal handlers */
@@ -1159,6 +2006,7 @@ static bool q_quit(int argc, char *argv[])
             tmp = qctx = list_entry(cur, queue_contex_t, chain);
             cur = cur->next;
             q_free(qctx->q);
+            entropy_clear(&((locked_contex_t *) qctx)->entropy);
             free(tmp);
             chain.size--;
         }
@@ -1179,11 +2027,12 @@ static bool q_quit(int argc, char *argv[])
 
 static void usage(char *cmd)
 {
-    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE]\n", cmd);
+    printf("Usage: %s [-h] [-f IFILE][-v VLEVEL][-l LFILE][-j JFILE]\n", cmd);
     printf("\t-h         Print this information\n");
     printf("\t-f IFILE   Read commands from IFILE\n");
     printf("\t-v VLEVEL  Set verbosity level\n");
     printf("\t-l LFILE   Echo results to LFILE\n");
+    printf("\t-j JFILE   Write per-command statistics as JSON lines\n");
     exit(0);
 }
 
@@ -1251,10 +2100,12 @@ int main(int argc, char *argv[])
     char *infile_name = NULL;
     char lbuf[BUFSIZE];
     char *logfile_name = NULL;
+    char jbuf[BUFSIZE];
+    char *statfile_name = NULL;
     int level = 4;
     int c;
 
-    while ((c = getopt(argc, argv, "hv:f:l:")) != -1) {
+    while ((c = getopt(argc, argv, "hv:f:l:j:")) != -1) {
         switch (c) {
         case 'h':
             usage(argv[0]);
@@ -1279,6 +2130,11 @@ int main(int argc, char *argv[])
             buf[BUFSIZE - 1] = '\0';
             logfile_name = lbuf;
             break;
+        case 'j':
+            strncpy(jbuf, optarg, BUFSIZE);
+            jbuf[BUFSIZE - 1] = '\0';
+            statfile_name = jbuf;
+            break;
         default:
             printf("Unknown option '%c'\n", c);
             usage(argv[0]);
@@ -1309,6 +2165,10 @@ int main(int argc, char *argv[])
         set_echo(true);
     if (logfile_name)
         set_logfile(logfile_name);
+    if (statfile_name && !set_statfile(statfile_name)) {
+        fprintf(stderr, "Could not open statistics file '%s'\n", statfile_name);
+        exit(EXIT_FAILURE);
+    }
 
     add_quit_helper(q_quit);
 
@@ -28,6 +28,10 @@
 #define _GNU_SOURCE
 #endif
 
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
 #include "random.h"
 
 #if defined(__linux__) || defined(__GNU__)
@@ -266,7 +270,7 @@ static int randombytes_bsd_randombytes(void *buf, size_t n)
     /* We prefere CCRandomGenerateBytes as it returns an error code while
      * arc4random_buf may fail silently on macOS.
      */
-    return (CCRandomGenerateBytes(buf, n) == kCCSuccess);
+    return CCRandomGenerateBytes(buf, n) == kCCSuccess ? 0 : -1;
 #else
     arc4random_buf(buf, n);
     return 0;
@@ -274,7 +278,8 @@ static int randombytes_bsd_randombytes(void *buf, size_t n)
 }
 #endif
 
-int randombytes(uint8_t *buf, size_t n)
+/* Seed material straight from the operating system */
+static int randombytes_os(uint8_t *buf, size_t n)
 {
 #if defined(__linux__) || defined(__GNU__)
 #if defined(USE_GLIBC)
@@ -293,3 +298,114 @@ int randombytes(uint8_t *buf, size_t n)
 #error "randombytes(...) is not supported on this platform"
 #endif
 }
+
+/* randombytes() used to make a system call for every request, and qtest asks
+ * for a few bytes per random string.  Instead, each thread seeds a ChaCha20
+ * key once and serves requests from a buffer of its keystream.  After every
+ * refill the key is replaced with the first bytes of the new keystream, so
+ * earlier output cannot be recovered from the state ("fast key erasure").
+ */
+#define CHACHA_BLOCK_SIZE 64
+#define CHACHA_KEY_SIZE 32
+#define RANDOM_BUF_SIZE (64 * CHACHA_BLOCK_SIZE)
+
+typedef struct {
+    uint32_t key[CHACHA_KEY_SIZE / 4];
+    uint8_t buf[RANDOM_BUF_SIZE];
+    size_t pos;
+    bool seeded;
+} random_state_t;
+
+static __thread random_state_t rng;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTERROUND(x, a, b, c, d)     \
+    do {                                \
+        x[a] += x[b];                   \
+        x[d] = ROTL32(x[d] ^ x[a], 16); \
+        x[c] += x[d];                   \
+        x[b] = ROTL32(x[b] ^ x[c], 12); \
+        x[a] += x[b];                   \
+        x[d] = ROTL32(x[d] ^ x[a], 8);  \
+        x[c] += x[d];                   \
+        x[b] = ROTL32(x[b] ^ x[c], 7);  \
+    } while (0)
+
+/* One block of ChaCha20 (RFC 8439) with a zero nonce */
+static void chacha20_block(const uint32_t key[8], uint32_t counter,
+                           uint8_t out[CHACHA_BLOCK_SIZE])
+{
+    uint32_t in[16] = {0x61707865, 0x3320646e, 0x79622d32, 0x6b206574};
+    for (int i = 0; i < 8; i++)
+        in[4 + i] = key[i];
+    in[12] = counter;
+
+    uint32_t x[16];
+    memcpy(x, in, sizeof(x));
+    for (int i = 0; i < 10; i++) {
+        QUARTERROUND(x, 0, 4, 8, 12);
+        QUARTERROUND(x, 1, 5, 9, 13);
+        QUARTERROUND(x, 2, 6, 10, 14);
+        QUARTERROUND(x, 3, 7, 11, 15);
+        QUARTERROUND(x, 0, 5, 10, 15);
+        QUARTERROUND(x, 1, 6, 11, 12);
+        QUARTERROUND(x, 2, 7, 8, 13);
+        QUARTERROUND(x, 3, 4, 9, 14);
+    }
+    for (int i = 0; i < 16; i++) {
+        uint32_t v = x[i] + in[i];
+        out[4 * i] = v;
+        out[4 * i + 1] = v >> 8;
+        out[4 * i + 2] = v >> 16;
+        out[4 * i + 3] = v >> 24;
+    }
+}
+
+static void random_refill(random_state_t *r)
+{
+    for (uint32_t i = 0; i < RANDOM_BUF_SIZE / CHACHA_BLOCK_SIZE; i++)
+        chacha20_block(r->key, i, r->buf + i * CHACHA_BLOCK_SIZE);
+    memcpy(r->key, r->buf, CHACHA_KEY_SIZE);
+    memset(r->buf, 0, CHACHA_KEY_SIZE);
+    r->pos = CHACHA_KEY_SIZE;
+}
+
+/* A forked child would otherwise repeat the output of its parent */
+static void random_atfork_child(void)
+{
+    rng.seeded = false;
+}
+
+static void random_atfork(void)
+{
+    pthread_atfork(NULL, NULL, random_atfork_child);
+}
+
+int randombytes(uint8_t *buf, size_t n)
+{
+    random_state_t *r = &rng;
+    if (!r->seeded) {
+        pthread_once(&atfork_once, random_atfork);
+        int ret = randombytes_os((uint8_t *) r->key, sizeof(r->key));
+        if (ret != 0)
+            return ret;
+        r->seeded = true;
+        r->pos = RANDOM_BUF_SIZE;
+    }
+
+    while (n > 0) {
+        if (r->pos == RANDOM_BUF_SIZE)
+            random_refill(r);
+        size_t chunk = RANDOM_BUF_SIZE - r->pos;
+        if (chunk > n)
+            chunk = n;
+        memcpy(buf, r->buf + r->pos, chunk);
+        /* Bytes handed out are never kept around */
+        memset(r->buf + r->pos, 0, chunk);
+        r->pos += chunk;
+        buf += chunk;
+        n -= chunk;
+    }
+    return 0;
+}
@@ -4,6 +4,9 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/* Fill buf with len bytes of a ChaCha20 keystream seeded by the system.
+ * Return 0 on success, or non-zero if the seed could not be obtained.
+ */
 extern int randombytes(uint8_t *buf, size_t len);
 
 static inline uint8_t randombit(void)
@@ -96,7 +96,7 @@ void report_event(message_t msg, char *fmt, ...)
 }
 
 #define BUF_SIZE 4096
-extern int web_connfd;
+extern __thread int web_connfd;
 void report(int level, char *fmt, ...)
 {
     if (!verbfile)
@@ -118,15 +118,13 @@ void report(int level, char *fmt, ...)
             fflush(logfile);
             va_end(ap);
         }
-        va_start(ap, fmt);
-        vsnprintf(buffer, BUF_SIZE, fmt, ap);
-        va_end(ap);
-    }
-    if (web_connfd) {
-        int len = strlen(buffer);
-        buffer[len] = '\n';
-        buffer[len + 1] = '\0';
-        web_send(web_connfd, buffer);
+        if (web_connfd) {
+            va_start(ap, fmt);
+            vsnprintf(buffer, BUF_SIZE, fmt, ap);
+            va_end(ap);
+            web_send(web_connfd, buffer);
+            web_send(web_connfd, "\n");
+        }
     }
 }
 
@@ -149,13 +147,13 @@ void report_noreturn(int level, char *fmt, ...)
             fflush(logfile);
             va_end(ap);
         }
-        va_start(ap, fmt);
-        vsnprintf(buffer, BUF_SIZE, fmt, ap);
-        va_end(ap);
+        if (web_connfd) {
+            va_start(ap, fmt);
+            vsnprintf(buffer, BUF_SIZE, fmt, ap);
+            va_end(ap);
+            web_send(web_connfd, buffer);
+        }
     }
-
-    if (web_connfd)
-        web_send(web_connfd, buffer);
 }
 
 /* Functions denoting failures */
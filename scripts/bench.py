@@ -0,0 +1,279 @@
+#!/usr/bin/env python3
+
+from __future__ import print_function
+import getopt
+import json
+import math
+import os
+import subprocess
+import sys
+import tempfile
+
+
+# Benchmark driver: sweeps queue sizes and string lengths, runs every queue
+# operation with warm-up and repetitions through 'qtest -j', then reports
+# median/p99 latency and the complexity model fitting the medians best.
+class Bench:
+
+    qtest = "./qtest"
+    sizes = [1000, 10000, 100000, 1000000, 10000000]
+    lengths = [8, 64, 256]
+    warmup = 1
+    reps = 5
+    # Number of removals timed on each prepared queue
+    removes = 100
+    # Per-command time limit in seconds handed to 'option timeout'
+    timeout = 60
+
+    # name -> (command measured, whether cost is per queue element,
+    #          whether the queue holds a fixed payload of each string length)
+    ops = {
+        "insert": ("it", True, True),
+        "remove": ("rh", True, True),
+        "reverse": ("reverse", False, True),
+        "reverseK": ("reverseK", False, True),
+        "sort": ("sort", False, False),
+        "sort_linux": ("sort_linux", False, False),
+        "merge": ("merge", False, False),
+        "dedup": ("dedup", False, False),
+        "descend": ("descend", False, False),
+        "shuffle": ("shuffle", False, True),
+    }
+
+    # Candidate complexity models, ordered from cheapest to most expensive
+    models = [
+        ("O(1)", lambda n: 1.0),
+        ("O(log n)", lambda n: math.log2(n)),
+        ("O(n)", lambda n: float(n)),
+        ("O(n log n)", lambda n: n * math.log2(n)),
+        ("O(n^2)", lambda n: float(n) * n),
+    ]
+
+    def __init__(self, qtest="", sizes=None, lengths=None, ops=None,
+                 warmup=1, reps=5):
+        if qtest != "":
+            self.qtest = qtest
+        if sizes:
+            self.sizes = sizes
+        if lengths:
+            self.lengths = lengths
+        self.selected = ops if ops else list(self.ops.keys())
+        self.warmup = warmup
+        self.reps = reps
+        self.results = []
+
+    def script(self, op, n, length):
+        """Build the qtest script for one (operation, size, length) point.
+        Order sensitive operations use random strings, the others use a
+        fixed payload of the requested length.
+        """
+        payload = "x" * length
+        # Checking every removed element against all allocated blocks would
+        # make removal take time linear in the size of the queue
+        lines = ["option fail 0", "option malloc 0", "option cautious 0",
+                 "option timeout %d" % self.timeout]
+        for r in range(self.warmup + self.reps):
+            if op == "insert":
+                lines += ["new", "it %s %d" % (payload, n), "free"]
+            elif op == "remove":
+                lines += ["new", "it %s %d" % (payload, n)]
+                lines += ["rh"] * min(self.removes, n)
+                lines += ["free"]
+            elif op == "merge":
+                lines += ["new", "ih RAND %d" % (n // 2), "sort",
+                          "new", "ih RAND %d" % (n - n // 2), "sort",
+                          "merge", "free"]
+            elif op == "reverseK":
+                lines += ["new", "ih %s %d" % (payload, n), "reverseK 3",
+                          "free"]
+            elif op in ("reverse", "shuffle"):
+                lines += ["new", "ih %s %d" % (payload, n), op, "free"]
+            else:
+                lines += ["new", "ih RAND %d" % n, self.ops[op][0], "free"]
+        return "\n".join(lines) + "\n"
+
+    def measure(self, op, n, length):
+        """Return per-command latencies in ns after warm-up, None on failure"""
+        cmd, per_element, _ = self.ops[op]
+        fd, sname = tempfile.mkstemp(prefix="qtest-bench.", suffix=".cmd")
+        with os.fdopen(fd, "w") as f:
+            f.write(self.script(op, n, length))
+        fd, jname = tempfile.mkstemp(prefix="qtest-bench.")
+        os.close(fd)
+        try:
+            retcode = subprocess.call(
+                [self.qtest, "-v", "0", "-f", sname, "-j", jname],
+                stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+            recs = []
+            with open(jname) as f:
+                for line in f:
+                    try:
+                        recs.append(json.loads(line))
+                    except ValueError:
+                        pass
+        finally:
+            os.remove(sname)
+            os.remove(jname)
+        if retcode != 0:
+            return None
+
+        samples = []
+        for rec in recs:
+            if rec["cmd"] != cmd or not rec["ok"]:
+                continue
+            ns = float(rec["ns"])
+            if per_element and rec["ops"] > 0:
+                ns /= rec["ops"]
+            samples.append(ns)
+        # Remove commands run once per repetition, inserts only once too
+        per_rep = len(samples) // (self.warmup + self.reps)
+        samples = samples[self.warmup * per_rep:]
+        return samples if samples else None
+
+    @staticmethod
+    def percentile(samples, p):
+        s = sorted(samples)
+        k = max(0, int(math.ceil(p / 100.0 * len(s))) - 1)
+        return s[k]
+
+    @staticmethod
+    def median(values):
+        s = sorted(values)
+        mid = len(s) // 2
+        return s[mid] if len(s) % 2 else (s[mid - 1] + s[mid]) / 2.0
+
+    def fit(self, points):
+        """Compare the growth of t between every two sizes, as the qtest
+        complexity command does: the exponent k of t = n^k is the median slope
+        in log space, its noise comes from the scatter around that line, and
+        the closest model by exponent over the sizes measured fits.
+        Return ((best model, runner-up, k, noise), ambiguous), where
+        ambiguous models are within noise of each other, the slower growing
+        named first.
+        """
+        pts = [(math.log(n), math.log(t)) for n, t in points if t > 0]
+        if len(pts) < 3:
+            return (None, None, 0.0, 0.0), False
+        k = self.median([(y1 - y0) / (x1 - x0)
+                         for i, (x1, y1) in enumerate(pts)
+                         for x0, y0 in pts[:i]])
+        c = self.median([y - k * x for x, y in pts])
+        mean = sum(x for x, _ in pts) / len(pts)
+        sxx = sum((x - mean) ** 2 for x, _ in pts)
+        noise = 1.4826 * self.median([abs(y - k * x - c)
+                                      for x, y in pts]) / math.sqrt(sxx)
+        lo, hi = points[0][0], points[-1][0]
+        dists = sorted((abs(k - math.log(f(hi) / f(lo)) / math.log(hi / lo)),
+                        i, name) for i, (name, f) in enumerate(self.models))
+        best, second = dists[0], dists[1]
+        if second[0] - best[0] < 2 * noise:
+            best, second = sorted([best, second], key=lambda d: d[1])
+            return (best[2], second[2], k, noise), True
+        return (best[2], second[2], k, noise), False
+
+    def run(self):
+        # Operations on the whole queue have one sample per repetition, so
+        # their p99 only differs from the maximum with -r above 100
+        print("%-12s%10s%8s%14s%14s" % ("op", "n", "len", "median(ns)",
+                                         "p99(ns)"))
+        for op in self.selected:
+            if op not in self.ops:
+                print("Unknown operation '%s'" % op)
+                continue
+            # Random strings have lengths of their own
+            lengths = self.lengths if self.ops[op][2] else self.lengths[:1]
+            for length in lengths:
+                points = []
+                for n in self.sizes:
+                    samples = self.measure(op, n, length)
+                    if samples is None:
+                        print("%-12s%10d%8d%14s" % (op, n, length, "failed"))
+                        # Larger sizes would fail as well
+                        break
+                    med = self.percentile(samples, 50)
+                    p99 = self.percentile(samples, 99)
+                    points.append((n, med))
+                    self.results.append({"op": op, "n": n, "len": length,
+                                         "median_ns": med, "p99_ns": p99,
+                                         "samples": len(samples)})
+                    print("%-12s%10d%8d%14.1f%14.1f" % (op, n, length, med,
+                                                         p99))
+                    sys.stdout.flush()
+                (model, second, k, noise), ambiguous = self.fit(points)
+                if model and ambiguous:
+                    print("%-12s fit %s or %s, ambiguous: grows as n^%.2f "
+                          "+/- %.2f" % (op, model, second, k, noise))
+                elif model:
+                    print("%-12s fit %s: grows as n^%.2f +/- %.2f, next "
+                          "closest %s" % (op, model, k, noise, second))
+                if model:
+                    self.results.append({"op": op, "len": length,
+                                         "fit": model, "next": second,
+                                         "growth": k, "noise": noise,
+                                         "ambiguous": ambiguous})
+
+    def save(self, fname):
+        with open(fname, "w") as f:
+            json.dump(self.results, f, indent=2)
+            f.write("\n")
+
+
+def usage(name):
+    print("Usage: %s [-h] [-p PROG] [-n SIZES] [-l LENGTHS] [-o OPS]" % name)
+    print("       [-w WARMUP] [-r REPS] [--max N] [--json FILE]")
+    print("  -h         Print this message")
+    print("  -p PROG    Program to test")
+    print("  -n SIZES   Comma separated queue sizes (default: 1e3,...,1e7)")
+    print("  -l LENGTHS Comma separated string lengths (default: 8,64,256)")
+    print("  -o OPS     Comma separated operations (default: all)")
+    print("  -w WARMUP  Warm-up repetitions discarded (default: 1)")
+    print("  -r REPS    Measured repetitions (default: 5)")
+    print("  --max N    Drop queue sizes larger than N")
+    print("  --json FILE Save results to FILE")
+    sys.exit(0)
+
+
+def run(name, args):
+    prog = ""
+    sizes = None
+    lengths = None
+    ops = None
+    warmup = 1
+    reps = 5
+    maxsize = None
+    output = None
+
+    optlist, args = getopt.getopt(args, 'hp:n:l:o:w:r:', ['max=', 'json='])
+    for (opt, val) in optlist:
+        if opt == '-h':
+            usage(name)
+        elif opt == '-p':
+            prog = val
+        elif opt == '-n':
+            sizes = [int(float(x)) for x in val.split(',')]
+        elif opt == '-l':
+            lengths = [int(x) for x in val.split(',')]
+        elif opt == '-o':
+            ops = val.split(',')
+        elif opt == '-w':
+            warmup = int(val)
+        elif opt == '-r':
+            reps = max(1, int(val))
+        elif opt == '--max':
+            maxsize = int(float(val))
+        elif opt == '--json':
+            output = val
+        else:
+            print("Unrecognized option '%s'" % opt)
+            usage(name)
+    b = Bench(qtest=prog, sizes=sizes, lengths=lengths, ops=ops,
+              warmup=warmup, reps=reps)
+    if maxsize:
+        b.sizes = [n for n in b.sizes if n <= maxsize]
+    b.run()
+    if output:
+        b.save(output)
+
+
+if __name__ == "__main__":
+    run(sys.argv[0], sys.argv[1:])
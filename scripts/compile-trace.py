@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+
+from __future__ import print_function
+import getopt
+import struct
+import sys
+
+
+# Compile a qtest command file into the binary trace format described in
+# trace.h.  Lines are split into words the way qtest does, command names
+# are stored once and referenced by index, and identical strings are shared.
+class Compiler:
+
+    magic = b"QTC1"
+
+    def __init__(self):
+        self.names = {}
+        self.records = []
+        self.strings = {}
+        self.max_args = 0
+
+    def add(self, line):
+        words = line.split()
+        if not words:
+            return
+        cmd = self.names.setdefault(words[0], len(self.names))
+        self.records.append((cmd, words[1:]))
+        self.max_args = max(self.max_args, len(words))
+
+    def build(self):
+        # Strings follow the header, the name offsets and the records
+        words = 4 + len(self.names)
+        words += sum(2 + len(args) for _, args in self.records)
+        blob = bytearray()
+
+        def offset(s):
+            if s not in self.strings:
+                self.strings[s] = words * 4 + len(blob)
+                blob.extend(s + b"\0")
+            return self.strings[s]
+
+        out = [self.magic, struct.pack("<III", len(self.names),
+                                       len(self.records), self.max_args)]
+        names = sorted(self.names, key=self.names.get)
+        out += [struct.pack("<I", offset(n)) for n in names]
+        for cmd, args in self.records:
+            out.append(struct.pack("<II", cmd, len(args) + 1))
+            out += [struct.pack("<I", offset(a)) for a in args]
+        if not blob:
+            blob.extend(b"\0")
+        return b"".join(out) + bytes(blob)
+
+
+def usage(name):
+    print("Usage: %s [-h] [-o OUTPUT] INPUT" % name)
+    print("  -h         Print this message")
+    print("  -o OUTPUT  Compiled trace (default: INPUT with .qtc suffix)")
+    print("Run the result with 'qtest -f OUTPUT' or 'source OUTPUT'")
+    sys.exit(0)
+
+
+def run(name, args):
+    output = None
+    optlist, args = getopt.getopt(args, 'ho:')
+    for (opt, val) in optlist:
+        if opt == '-h':
+            usage(name)
+        elif opt == '-o':
+            output = val
+    if len(args) != 1:
+        usage(name)
+
+    src = args[0]
+    if not output:
+        base = src[:-4] if src.endswith(".cmd") else src
+        output = base + ".qtc"
+
+    c = Compiler()
+    with open(src, "rb") as f:
+        for line in f:
+            c.add(line)
+    with open(output, "wb") as f:
+        f.write(c.build())
+    print("%s: %d commands, %d distinct" % (output, len(c.records),
+                                           len(c.names)))
+
+
+if __name__ == "__main__":
+    run(sys.argv[0], sys.argv[1:])
@@ -4,6 +4,10 @@ from __future__ import print_function
 import subprocess
 import sys
 import getopt
+import json
+import os
+import statistics
+import tempfile
 
 
 
@@ -17,6 +21,7 @@ class Tracer:
     autograde = False
     useValgrind = False
     colored = False
+    statFile = None
 
     traceDict = {
         1: "trace-01-ops",
@@ -69,13 +74,15 @@ class Tracer:
                  verbLevel=0,
                  autograde=False,
                  useValgrind=False,
-                 colored=False):
+                 colored=False,
+                 bench=None):
         if qtest != "":
             self.qtest = qtest
         self.verbLevel = verbLevel
         self.autograde = autograde
         self.useValgrind = useValgrind
         self.colored = colored
+        self.bench = bench
 
     def printInColor(self, text, color):
         if self.colored == False:
@@ -89,6 +96,8 @@ class Tracer:
         fname = "%s/%s.cmd" % (self.traceDirectory, self.traceDict[tid])
         vname = "%d" % self.verbLevel
         clist = self.command + ["-v", vname, "-f", fname]
+        if self.statFile:
+            clist += ["-j", self.statFile]
 
         try:
             retcode = subprocess.call(clist)
@@ -117,7 +126,17 @@ class Tracer:
             tname = self.traceDict[t]
             if self.verbLevel > 0:
                 print("+++ TESTING trace %s:" % tname)
-            ok = self.runTrace(t)
+            if self.bench:
+                ok = True
+                for r in range(self.bench.runs):
+                    fd, self.statFile = tempfile.mkstemp(prefix="qtest-stat.")
+                    os.close(fd)
+                    ok = self.runTrace(t) and ok
+                    self.bench.load(tname, self.statFile)
+                    os.remove(self.statFile)
+                self.statFile = None
+            else:
+                ok = self.runTrace(t)
             maxval = self.maxScores[t]
             tval = maxval if ok else 0
             if tval < maxval:
@@ -142,16 +161,113 @@ class Tracer:
                 jstring += '"%s" : %d' % (self.traceProbs[k], scoreDict[k])
             jstring += '}}'
             print(jstring)
-        if score < maxscore:
+        regressed = False
+        if self.bench:
+            if self.bench.output:
+                self.bench.save(self.bench.output)
+            if self.bench.baseline:
+                regressed = not self.bench.compare(
+                    self.bench.baseline,
+                    lambda text, bad: self.printInColor(
+                        text, self.RED if bad else self.GREEN))
+        if score < maxscore or regressed:
             sys.exit(1)
 
+# Aggregate per-command statistics emitted by 'qtest -j' and compare them
+# against a saved baseline
+class Bench:
+
+    # Timings below this many nanoseconds are too noisy to compare
+    noiseFloor = 1000000
+
+    def __init__(self, output=None, baseline=None, runs=1, threshold=10.0):
+        self.output = output
+        self.baseline = baseline
+        self.runs = runs
+        self.threshold = threshold
+        # trace name -> list of per-run {command: totals}
+        self.samples = {}
+
+    def load(self, tname, fname):
+        totals = {}
+        with open(fname) as f:
+            for line in f:
+                try:
+                    rec = json.loads(line)
+                except ValueError:
+                    continue
+                t = totals.setdefault(rec["cmd"], {
+                    "calls": 0, "ns": 0, "ops": 0, "allocs": 0,
+                    "peak_bytes": 0})
+                t["calls"] += 1
+                t["ns"] += rec["ns"]
+                t["ops"] += rec["ops"]
+                t["allocs"] += rec["allocs"]
+                t["peak_bytes"] = max(t["peak_bytes"], rec["peak_bytes"])
+        self.samples.setdefault(tname, []).append(totals)
+
+    def aggregate(self):
+        traces = {}
+        for tname, runs in self.samples.items():
+            cmds = {}
+            for name in sorted(set(k for r in runs for k in r)):
+                rs = [r[name] for r in runs if name in r]
+                ns = statistics.median(r["ns"] for r in rs)
+                ops = rs[0]["ops"]
+                cmds[name] = {
+                    "calls": rs[0]["calls"],
+                    "ns": ns,
+                    "ops": ops,
+                    "ops_per_sec": ops * 1e9 / ns if ns > 0 else 0.0,
+                    "allocs": rs[0]["allocs"],
+                    "peak_bytes": max(r["peak_bytes"] for r in rs),
+                }
+            total = statistics.median(
+                sum(c["ns"] for c in r.values()) for r in runs)
+            traces[tname] = {"total_ns": total, "commands": cmds}
+        return {"runs": self.runs, "traces": traces}
+
+    def save(self, fname):
+        with open(fname, "w") as f:
+            json.dump(self.aggregate(), f, indent=2, sort_keys=True)
+            f.write("\n")
+
+    def compare(self, fname, printer):
+        with open(fname) as f:
+            base = json.load(f)["traces"]
+        cur = self.aggregate()["traces"]
+        regressed = False
+        print("---\tTrace/command\t\tBaseline(ms)\tCurrent(ms)\tChange")
+        for tname in sorted(cur):
+            if tname not in base:
+                continue
+            pairs = [(tname, base[tname]["total_ns"], cur[tname]["total_ns"])]
+            for cname, c in sorted(cur[tname]["commands"].items()):
+                b = base[tname]["commands"].get(cname)
+                if b:
+                    pairs.append(("  " + cname, b["ns"], c["ns"]))
+            for label, b, c in pairs:
+                change = (c - b) * 100.0 / b if b else 0.0
+                bad = b >= self.noiseFloor and change > self.threshold
+                regressed = regressed or bad
+                text = "---\t%-16s\t%.3f\t\t%.3f\t\t%+.1f%%" % (
+                    label, b / 1e6, c / 1e6, change)
+                printer(text, bad)
+        return not regressed
+
+
 def usage(name):
     print("Usage: %s [-h] [-p PROG] [-t TID] [-v VLEVEL] [--valgrind] [-c]" % name)
+    print("       [--json FILE] [--runs N] [--baseline FILE] [--threshold PCT]")
     print("  -h        Print this message")
     print("  -p PROG   Program to test")
     print("  -t TID    Trace ID to test")
     print("  -v VLEVEL Set verbosity level (0-3)")
     print("  -c Enable colored text")
+    print("  --json FILE      Save aggregated per-command statistics to FILE")
+    print("  --runs N         Run each trace N times when collecting statistics")
+    print("  --baseline FILE  Compare statistics against a saved --json FILE")
+    print("  --threshold PCT  Slowdown tolerated against baseline (default: 10)")
     sys.exit(0)
 
 
@@ -163,8 +279,14 @@ def run(name, args):
     autograde = False
     useValgrind = False
     colored = False
+    output = None
+    baseline = None
+    runs = 1
+    threshold = 10.0
 
-    optlist, args = getopt.getopt(args, 'hp:t:v:A:c', ['valgrind'])
+    optlist, args = getopt.getopt(
+        args, 'hp:t:v:A:c',
+        ['valgrind', 'json=', 'runs=', 'baseline=', 'threshold='])
     for (opt, val) in optlist:
         if opt == '-h':
             usage(name)
@@ -181,16 +303,31 @@ def run(name, args):
             useValgrind = True
         elif opt == '-c':
             colored = True
+        elif opt == '--json':
+            output = val
+        elif opt == '--runs':
+            runs = max(1, int(val))
+        elif opt == '--baseline':
+            baseline = val
+        elif opt == '--threshold':
+            threshold = float(val)
         else:
             print("Unrecognized option '%s'" % opt)
             usage(name)
     if not levelFixed and autograde:
         vlevel = 0
+    bench = None
+    if output or baseline:
+        bench = Bench(output=output,
+                      baseline=baseline,
+                      runs=runs,
+                      threshold=threshold)
     t = Tracer(qtest=prog,
                verbLevel=vlevel,
                autograde=autograde,
                useValgrind=useValgrind,
-               colored=colored)
+               colored=colored,
+               bench=bench)
     t.run(tid)
 
 
@@ -8,6 +8,38 @@
 /* Shannon full integer entropy calculation */
 #define BUCKET_SIZE (1 << 8)
 
+/* Runs of one character make every increment of its bucket wait for the
+ * previous one.  Counting into separate histograms lets them overlap.
+ */
+#define SUB_HISTOGRAMS 4
+
+/* Entropy summed over the buckets of a histogram of count characters */
+static uint64_t entropy_buckets(const uint32_t *bucket, uint64_t count)
+{
+    uint64_t entropy_sum = 0;
+    for (uint32_t i = 0; i < BUCKET_SIZE; i++) {
+        /* Empty buckets add nothing, without a branch to skip them */
+        uint64_t p = bucket[i] * (LOG2_ARG_SHIFT / count);
+        entropy_sum += p * -log2_lshift16(p);
+    }
+    return entropy_sum;
+}
+
+/* The same sum taken over the characters of s, for strings shorter than
+ * the histogram.  Each of the bucket[c] occurrences of c adds 1/bucket[c]
+ * of the term of bucket c.
+ */
+static uint64_t entropy_chars(const uint8_t *s,
+                              const uint32_t *bucket,
+                              uint64_t count)
+{
+    const uint64_t scale = LOG2_ARG_SHIFT / count;
+    uint64_t entropy_sum = 0;
+    for (uint64_t i = 0; i < count; i++)
+        entropy_sum += scale * -log2_lshift16(bucket[s[i]] * scale);
+    return entropy_sum;
+}
+
 double shannon_entropy(const uint8_t *s)
 {
     assert(s);
@@ -15,18 +47,29 @@ double shannon_entropy(const uint8_t *s)
     uint64_t entropy_sum = 0;
     const uint64_t entropy_max = 8 * LOG2_RET_SHIFT;
 
-    uint32_t bucket[256];
-    memset(&bucket, 0, sizeof(bucket));
-
-    for (uint32_t i = 0; i < count; i++)
-        bucket[s[i]]++;
+    if (!count)
+        return 0;
 
-    for (uint32_t i = 0; i < BUCKET_SIZE; i++) {
-        if (bucket[i]) {
-            uint64_t p = bucket[i];
-            p *= LOG2_ARG_SHIFT / count;
-            entropy_sum += -p * log2_lshift16(p);
+    uint32_t bucket[SUB_HISTOGRAMS][BUCKET_SIZE];
+    if (count < BUCKET_SIZE) {
+        memset(bucket[0], 0, sizeof(bucket[0]));
+        for (uint64_t i = 0; i < count; i++)
+            bucket[0][s[i]]++;
+        entropy_sum = entropy_chars(s, bucket[0], count);
+    } else {
+        memset(bucket, 0, sizeof(bucket));
+        uint64_t i = 0;
+        for (; i + SUB_HISTOGRAMS <= count; i += SUB_HISTOGRAMS) {
+            bucket[0][s[i]]++;
+            bucket[1][s[i + 1]]++;
+            bucket[2][s[i + 2]]++;
+            bucket[3][s[i + 3]]++;
         }
+        for (; i < count; i++)
+            bucket[0][s[i]]++;
+        for (uint32_t j = 0; j < BUCKET_SIZE; j++)
+            bucket[0][j] += bucket[1][j] + bucket[2][j] + bucket[3][j];
+        entropy_sum = entropy_buckets(bucket[0], count);
     }
 
     entropy_sum /= LOG2_ARG_SHIFT;
@@ -0,0 +1,120 @@
+/* Memory-mapped compiled traces */
+
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+/* "QTC1" read as a little-endian word */
+#define TRACE_MAGIC 0x31435451U
+#define HEADER_WORDS 4
+
+bool trace_probe(int fd)
+{
+    char magic[4];
+    return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+           !memcmp(magic, "QTC1", sizeof(magic));
+}
+
+/* Check every offset once, so records can be run without any checks */
+static bool trace_check(trace_t *t, uint32_t records)
+{
+    const uint32_t *w = (const uint32_t *) t->base;
+    const uint32_t *limit = w + t->len / sizeof(uint32_t);
+
+    /* Strings end within the file if the file ends with a NUL */
+    if (!t->len || t->base[t->len - 1] != '\0')
+        return false;
+    if (t->names > (size_t) (limit - w - HEADER_WORDS))
+        return false;
+    for (uint32_t i = 0; i < t->names; i++) {
+        if (t->name_off[i] >= t->len)
+            return false;
+    }
+
+    const uint32_t *r = t->name_off + t->names;
+    for (uint32_t i = 0; i < records; i++) {
+        if (limit - r < 2 || r[0] >= t->names || !r[1] ||
+            r[1] > t->max_args || (uint32_t) (limit - r - 2) < r[1] - 1)
+            return false;
+        size_t bytes = strlen(trace_name(t, r[0])) + 1;
+        for (uint32_t j = 1; j < r[1]; j++) {
+            if (r[1 + j] >= t->len)
+                return false;
+            bytes += strlen(t->base + r[1 + j]) + 1;
+        }
+        if (bytes > t->max_bytes)
+            t->max_bytes = bytes;
+        r += r[1] + 1;
+    }
+    t->end = r;
+    return true;
+}
+
+bool trace_open(trace_t *t, int fd)
+{
+    struct stat st;
+    memset(t, 0, sizeof(*t));
+    if (fstat(fd, &st) < 0 ||
+        (size_t) st.st_size < HEADER_WORDS * sizeof(uint32_t))
+        return false;
+
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+        return false;
+    /* Records are run front to back exactly once */
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+
+    const uint32_t *w = p;
+    t->base = p;
+    t->len = st.st_size;
+    t->names = w[1];
+    t->max_args = w[3];
+    t->name_off = w + HEADER_WORDS;
+    t->next = t->name_off + t->names;
+    /* Words are little-endian, and so the magic only on such hosts */
+    if (w[0] != TRACE_MAGIC || !trace_check(t, w[2])) {
+        trace_close(t);
+        return false;
+    }
+    return true;
+}
+
+void trace_close(trace_t *t)
+{
+    if (t->base)
+        munmap((void *) t->base, t->len);
+    memset(t, 0, sizeof(*t));
+}
+
+/* Copy string s to buf, return the end of the copy */
+static char *copy_string(char *buf, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    memcpy(buf, s, len);
+    return buf + len;
+}
+
+bool trace_next(trace_t *t,
+                uint32_t *id,
+                int *argc,
+                char *argv[],
+                char *buf)
+{
+    const uint32_t *r = t->next;
+    if (r == t->end)
+        return false;
+
+    *id = r[0];
+    *argc = r[1];
+    argv[0] = buf;
+    buf = copy_string(buf, trace_name(t, r[0]));
+    for (uint32_t i = 1; i < r[1]; i++) {
+        argv[i] = buf;
+        buf = copy_string(buf, t->base + r[1 + i]);
+    }
+    t->next = r + r[1] + 1;
+    return true;
+}
@@ -0,0 +1,61 @@
+#ifndef LAB0_TRACE_H
+#define LAB0_TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Compiled traces, produced from command files by scripts/compile-trace.py.
+ *
+ * The file is a sequence of 32-bit little-endian words:
+ *   header   magic "QTC1", number of names, number of records, max argc
+ *   names    offset of each distinct command name
+ *   records  name index, argc, then the offsets of argv[1] to argv[argc-1]
+ * followed by the NUL-terminated strings.  Offsets are counted from the
+ * start of the file.  The file is memory-mapped and run in place: commands
+ * are resolved once per name.  Arguments stay strings, parsed by each
+ * command as usual, and are copied out of the mapping before it runs, as
+ * identical strings are stored once and commands may modify their own.
+ * Files are only accepted on hosts of the same byte order.
+ */
+
+typedef struct {
+    const char *base;
+    size_t len;
+    uint32_t names;
+    uint32_t max_args;
+    uint32_t max_bytes; /* Most string bytes in one record */
+    const uint32_t *name_off;
+    const uint32_t *next; /* Next record to run */
+    const uint32_t *end;
+} trace_t;
+
+/* Return whether the file behind fd starts like a compiled trace, whatever
+ * its byte order
+ */
+bool trace_probe(int fd);
+
+/* Map the compiled trace and validate it.  Return false if it is invalid
+ * or its byte order is not that of the host.
+ */
+bool trace_open(trace_t *t, int fd);
+
+void trace_close(trace_t *t);
+
+/* Name of command id */
+static inline const char *trace_name(const trace_t *t, uint32_t id)
+{
+    return t->base + t->name_off[id];
+}
+
+/* Fetch the next record, storing its arguments in argv, which has room for
+ * max_args entries, and their strings in buf, which has room for max_bytes.
+ * Return false at the end of the trace.
+ */
+bool trace_next(trace_t *t,
+                uint32_t *id,
+                int *argc,
+                char *argv[],
+                char *buf);
+
+#endif /* LAB0_TRACE_H */
@@ -4,17 +4,38 @@
 
 #include <arpa/inet.h> /* inet_ntoa */
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/tcp.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/epoll.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+#include <sys/event.h>
+#endif
+
+#include "list.h"
+#include "web.h"
+
 #define LISTENQ 1024 /* second argument to listen() */
-#define MAXLINE 1024 /* max length of a line */
 #define BUFSIZE 1024
 
+#define MAX_REQUEST 8192   /* largest request header accepted */
+#define MAX_BODY (64 << 20) /* largest posted trace accepted */
+#define MAX_EVENTS 64    /* readiness events handled per web_process() */
+#define IDLE_TIMEOUT 30  /* seconds an idle keep-alive connection is kept */
+#define OUT_BUFSIZE 16384 /* command output held back per connection */
+#define MAX_BACKLOG (4 << 20) /* response bytes a slow client may hold up */
+#define MAX_CONNS 4096 /* connections are refused on descriptors from here */
+
 #ifndef DEFAULT_PORT
 #define DEFAULT_PORT 9999 /* use this port if none given as arg to main() */
 #endif
@@ -23,55 +44,29 @@
 #define TCP_CORK TCP_NOPUSH
 #endif
 
-typedef struct {
-    int fd;            /* descriptor for this buf */
-    int count;         /* unread byte in this buf */
-    char *bufptr;      /* next unread byte in this buf */
-    char buf[BUFSIZE]; /* internal buffer */
-} rio_t;
-
 typedef struct {
     char filename[512];
     off_t offset; /* for support Range */
     size_t end;
+    size_t length; /* Content-Length of the body */
+    bool keep_alive;
+    bool script; /* Body is a trace to run, posted to /trace */
 } http_request_t;
 
-static void rio_readinitb(rio_t *rp, int fd)
-{
-    rp->fd = fd;
-    rp->count = 0;
-    rp->bufptr = rp->buf;
-}
-
-/* This is a wrapper for the Unix read() function that transfers min(n, count)
- * bytes from an internal buffer to a user buffer, where n is the number of
- * bytes requested by the user and count is the number of unread bytes in the
- * internal buffer. On entry, rio_read() refills the internal buffer via a call
- * to read() if the internal buffer is empty.
+/* Length of the first request header in buf, 0 if it is incomplete.
+ * Only line feeds are visited, each one checked for a following blank line.
  */
-/* $begin rio_read */
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
-{
-    int cnt;
-    while (rp->count <= 0) { /* refill if buf is empty */
-        rp->count = read(rp->fd, rp->buf, sizeof(rp->buf));
-        if (rp->count < 0) {
-            if (errno != EINTR) /* interrupted by sig handler return */
-                return -1;
-        } else if (rp->count == 0) { /* EOF */
-            return 0;
-        } else
-            rp->bufptr = rp->buf; /* reset buffer ptr */
-    }
-
-    /* Copy min(n, rp->count) bytes from internal buf to user buf */
-    cnt = n;
-    if (rp->count < n)
-        cnt = rp->count;
-    memcpy(usrbuf, rp->bufptr, cnt);
-    rp->bufptr += cnt;
-    rp->count -= cnt;
-    return cnt;
+static size_t header_length(const char *buf, size_t len)
+{
+    const char *p = buf, *end = buf + len;
+    while ((p = memchr(p, '\n', end - p))) {
+        p++;
+        if (p < end && *p == '\n')
+            return p + 1 - buf;
+        if (p + 1 < end && p[0] == '\r' && p[1] == '\n')
+            return p + 2 - buf;
+    }
+    return 0;
 }
 
 static ssize_t writen(int fd, void *usrbuf, size_t n)
@@ -82,9 +77,9 @@ static ssize_t writen(int fd, void *usrbuf, size_t n)
     while (nleft > 0) {
         ssize_t nwritten = write(fd, bufp, nleft);
         if (nwritten <= 0) {
-            if (errno == EINTR) { /* interrupted by sig handler return */
-                nwritten = 0;     /* and call write() again */
-            } else
+            if (errno == EINTR)  /* interrupted by sig handler return */
+                nwritten = 0;    /* and call write() again */
+            else
                 return -1; /* errorno set by write() */
         }
         nleft -= nwritten;
@@ -93,32 +88,495 @@ static ssize_t writen(int fd, void *usrbuf, size_t n)
     return n;
 }
 
-/* robustly read a text line (buffered) */
-static ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+static void url_decode(char *src, char *dest, int max)
+{
+    char *p = src;
+    char code[3] = {0};
+    while (*p && --max) {
+        if (*p == '%') {
+            memcpy(code, ++p, 2);
+            *dest++ = (char) strtoul(code, NULL, 16);
+            p += 2;
+        } else {
+            *dest++ = *p++;
+        }
+    }
+    *dest = '\0';
+}
+
+/* Case-insensitively match a header name, return its value or NULL */
+static char *header_value(char *line, size_t len, const char *name, size_t n)
+{
+    if (len <= n || strncasecmp(line, name, n))
+        return NULL;
+    line += n;
+    while (*line == ' ' || *line == '\t')
+        line++;
+    return line;
+}
+
+/* Parse the request header of len bytes held in buf.
+ * Lines are located with memchr and tokens are terminated in place, so
+ * nothing is copied except the decoded file name.
+ */
+static void parse_request(char *buf, size_t len, http_request_t *req)
 {
-    char c, *bufp = usrbuf;
+    char *end = buf + len, *line = buf, *next;
+    char *method = "", *uri = "", *version = "";
+    int connection = -1; /* Connection header: 0 close, 1 keep-alive */
+    req->offset = 0;
+    req->end = 0; /* default */
+    req->length = 0;
+
+    for (bool first = true; line < end; line = next, first = false) {
+        char *eol = memchr(line, '\n', end - line);
+        if (!eol)
+            break;
+        next = eol + 1;
+        if (eol > line && eol[-1] == '\r')
+            eol--;
+        *eol = '\0';
+        size_t n = eol - line;
+        if (n == 0) /* blank line ends the header */
+            break;
+
+        if (first) {
+            /* Request line: method, URI and version separated by spaces */
+            method = line;
+            char *sp = memchr(line, ' ', n);
+            if (sp) {
+                *sp = '\0';
+                uri = sp + 1;
+                sp = memchr(uri, ' ', eol - uri);
+                if (sp) {
+                    *sp = '\0';
+                    version = sp + 1;
+                }
+            }
+            continue;
+        }
+
+        char *value;
+        if ((value = header_value(line, n, "Range:", 6))) {
+            sscanf(value, "bytes=%lu-%lu", (unsigned long *) &req->offset,
+                   (unsigned long *) &req->end);
+            /* Range: [start, end] */
+            if (req->end != 0)
+                req->end++;
+        } else if ((value = header_value(line, n, "Connection:", 11))) {
+            if (!strncasecmp(value, "close", 5))
+                connection = 0;
+            else if (!strncasecmp(value, "keep-alive", 10))
+                connection = 1;
+        } else if ((value = header_value(line, n, "Content-Length:", 15))) {
+            req->length = strtoul(value, NULL, 10);
+        }
+    }
 
-    int n;
-    for (n = 1; n < maxlen; n++) {
-        int rc;
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-            *bufp++ = c;
-            if (c == '\n')
-                break;
-        } else if (rc == 0) {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            break;        /* EOF, some data was read */
-        } else
-            return -1; /* error */
+    /* Persistent connections are the default since HTTP/1.1 */
+    if (connection < 0)
+        req->keep_alive = !strcmp(version, "HTTP/1.1");
+    else
+        req->keep_alive = connection;
+
+    char *filename = uri;
+    if (uri[0] == '/') {
+        filename = uri + 1;
+        if (*filename == '\0') {
+            filename = ".";
+        } else {
+            char *query = strchr(filename, '?');
+            if (query)
+                *query = '\0';
+        }
+    }
+    url_decode(filename, req->filename, sizeof(req->filename));
+    req->script = !strcmp(method, "POST") && !strcmp(req->filename, "trace");
+}
+
+/* Turn the request path into a command line */
+static char *request_cmd(http_request_t *req)
+{
+    char *p = req->filename;
+    /* Change '/' to ' ' */
+    while (*p) {
+        ++p;
+        if (*p == '/')
+            *p = ' ';
     }
-    *bufp = 0;
+    char *ret = malloc(strlen(req->filename) + 1);
+    strncpy(ret, req->filename, strlen(req->filename) + 1);
+
+    return ret;
+}
+
+/* Event-driven handling of many concurrent connections.
+ *
+ * The listening socket and every client connection are non-blocking and
+ * registered with epoll (Linux) or kqueue (macOS/FreeBSD).  The multiplexer
+ * descriptor itself becomes readable whenever any of them has activity, so
+ * the console watches a single descriptor next to its command input.
+ * Complete requests are parsed into commands and queued for the interpreter
+ * in arrival order.
+ */
+
+typedef struct __web_conn {
+    int fd;
+    char *buf; /* Bytes received so far, NUL terminated */
+    size_t len, cap;
+    size_t hdr_len;  /* Length of the parsed header, 0 if not parsed yet */
+    size_t body_len; /* Length of the body following the header */
+    size_t used;     /* Length of the request being served */
+    char *out;       /* Command output not sent yet, OUT_BUFSIZE bytes */
+    size_t out_len;
+    char *tx;        /* Response bytes the socket could not take yet */
+    size_t tx_off, tx_len, tx_cap;
+    char *cmd;       /* Parsed command once the request completed */
+    bool keep_alive; /* Whether to wait for another request afterwards */
+    bool script;     /* Command is a posted trace, one command per line */
+    bool chunked;    /* Output is streamed with chunked transfer encoding */
+    bool started;    /* Response header has been sent */
+    bool failed;     /* Sending the response failed */
+    bool busy;       /* Command queued or running */
+    bool closing;    /* Close once the response has been sent */
+    bool eof;        /* Peer will not send anything more */
+    int events;      /* Events watched by the multiplexer, MUX_IN/MUX_OUT */
+    long last;       /* Time of the last activity in milliseconds */
+    struct list_head idle;   /* Position in idle_conns, unless busy */
+    void *data;      /* Set by the interpreter, see web_set_data() */
+    struct __web_conn *next; /* Next connection waiting for interpreter */
+} web_conn_t;
+
+#define MUX_IN 1  /* Wait for a request */
+#define MUX_OUT 2 /* Wait for room to send the rest of a response */
+
+static int listen_fd = -1;
+static int mux_fd = -1;
+
+/* Connections indexed by descriptor.  The table never moves, so commands
+ * running on worker threads can look up their connection while others are
+ * accepted.
+ */
+static web_conn_t *conns[MAX_CONNS];
+
+/* Connections which are not busy, least recently active first.  Only
+ * the main thread moves them, as commands on workers keep theirs busy.
+ */
+static LIST_HEAD(idle_conns);
+
+/* FIFO of connections with a command waiting to be interpreted */
+static web_conn_t *pending_head = NULL;
+static web_conn_t **pending_tail = &pending_head;
+
+static long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+static bool set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+static bool mux_add(int fd)
+{
+#if defined(__linux__)
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+    return epoll_ctl(mux_fd, EPOLL_CTL_ADD, fd, &ev) == 0;
+#else
+    struct kevent ev;
+    EV_SET(&ev, fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+    return kevent(mux_fd, &ev, 1, NULL, 0, NULL) == 0;
+#endif
+}
+
+/* Watch the connection for the events in mask, none if it is 0 */
+static bool mux_watch(web_conn_t *c, int mask)
+{
+    if (mask == c->events)
+        return true;
+#if defined(__linux__)
+    struct epoll_event ev = {.data.fd = c->fd};
+    ev.events = (mask & MUX_IN ? EPOLLIN : 0) | (mask & MUX_OUT ? EPOLLOUT : 0);
+    int op = !c->events ? EPOLL_CTL_ADD
+             : !mask    ? EPOLL_CTL_DEL
+                        : EPOLL_CTL_MOD;
+    bool ok = epoll_ctl(mux_fd, op, c->fd, &ev) == 0;
+#else
+    struct kevent ev[2];
+    int n = 0;
+    if ((mask ^ c->events) & MUX_IN)
+        EV_SET(&ev[n++], c->fd, EVFILT_READ,
+               mask & MUX_IN ? EV_ADD : EV_DELETE, 0, 0, NULL);
+    if ((mask ^ c->events) & MUX_OUT)
+        EV_SET(&ev[n++], c->fd, EVFILT_WRITE,
+               mask & MUX_OUT ? EV_ADD : EV_DELETE, 0, 0, NULL);
+    bool ok = kevent(mux_fd, ev, n, NULL, 0, NULL) == 0;
+#endif
+    /* A descriptor which failed to be removed is closed right after */
+    c->events = ok || !mask ? mask : c->events;
+    return ok;
+}
+
+/* Record activity, moving the connection to the end of idle_conns */
+static void conn_touch(web_conn_t *c)
+{
+    c->last = now_ms();
+    list_move_tail(&c->idle, &idle_conns);
+}
+
+/* Collect up to max descriptors which are ready, without blocking */
+static int mux_wait(int *fds, int max)
+{
+#if defined(__linux__)
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(mux_fd, events, max, 0);
+    for (int i = 0; i < n; i++)
+        fds[i] = events[i].data.fd;
+#else
+    struct kevent events[MAX_EVENTS];
+    struct timespec zero = {0, 0};
+    int n = kevent(mux_fd, NULL, 0, events, max, &zero);
+    for (int i = 0; i < n; i++)
+        fds[i] = (int) events[i].ident;
+#endif
     return n;
 }
 
-void web_send(int out_fd, char *buf)
+static void conn_close(web_conn_t *c)
 {
-    writen(out_fd, buf, strlen(buf));
+    mux_watch(c, 0);
+    list_del(&c->idle);
+    close(c->fd);
+    conns[c->fd] = NULL;
+    free(c->cmd);
+    free(c->out);
+    free(c->tx);
+    free(c->buf);
+    free(c);
+}
+
+/* The socket is corked, push out what has been written so far */
+static void conn_push(web_conn_t *c)
+{
+    int off = 0, on = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+/* Send queued response bytes until the socket is full.
+ * Return false if the connection failed.
+ */
+static bool conn_flush(web_conn_t *c)
+{
+    while (c->tx_off < c->tx_len) {
+        ssize_t n = write(c->fd, c->tx + c->tx_off, c->tx_len - c->tx_off);
+        if (n > 0)
+            c->tx_off += n;
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return true;
+        else
+            return false;
+    }
+    c->tx_off = c->tx_len = 0;
+    return true;
+}
+
+/* Send len bytes of a response without blocking.  What the socket cannot
+ * take is queued and sent by the event loop once the command is done.  A
+ * client which lets more than MAX_BACKLOG bytes pile up fails the response.
+ */
+static bool conn_write(web_conn_t *c, const void *buf, size_t len)
+{
+    if (c->failed || !conn_flush(c)) {
+        c->failed = true;
+        return false;
+    }
+    while (len && c->tx_off == c->tx_len) {
+        ssize_t n = write(c->fd, buf, len);
+        if (n > 0) {
+            buf = (const char *) buf + n;
+            len -= n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            c->failed = true;
+            return false;
+        }
+    }
+    if (!len)
+        return true;
+
+    size_t queued = c->tx_len - c->tx_off;
+    if (queued + len > MAX_BACKLOG) {
+        c->failed = true;
+        return false;
+    }
+    memmove(c->tx, c->tx + c->tx_off, queued);
+    c->tx_off = 0;
+    c->tx_len = queued;
+    if (queued + len > c->tx_cap) {
+        size_t cap = c->tx_cap ? c->tx_cap : BUFSIZE;
+        while (cap < queued + len)
+            cap *= 2;
+        char *tmp = realloc(c->tx, cap);
+        if (!tmp) {
+            c->failed = true;
+            return false;
+        }
+        c->tx = tmp;
+        c->tx_cap = cap;
+    }
+    memcpy(c->tx + c->tx_len, buf, len);
+    c->tx_len += len;
+    return true;
+}
+
+static void conn_accept(void)
+{
+    for (;;) {
+        struct sockaddr_in clientaddr;
+        socklen_t clientlen = sizeof(clientaddr);
+        int fd = accept(listen_fd, (struct sockaddr *) &clientaddr, &clientlen);
+        if (fd < 0)
+            return; /* EAGAIN: no more pending connections */
+
+        if (fd >= MAX_CONNS) {
+            close(fd); /* Too many connections to keep track of */
+            continue;
+        }
+
+        web_conn_t *c = calloc(1, sizeof(web_conn_t));
+        if (!c || !set_nonblocking(fd)) {
+            free(c);
+            close(fd);
+            continue;
+        }
+        /* Uncorking must flush responses without waiting for an ACK */
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        c->fd = fd;
+        INIT_LIST_HEAD(&c->idle);
+        conn_touch(c);
+        conns[fd] = c;
+        if (!mux_watch(c, MUX_IN))
+            conn_close(c);
+    }
+}
+
+/* Queue the command once a complete request has been received.
+ * Return false if the buffer holds no complete request yet.
+ */
+static bool conn_parse(web_conn_t *c)
+{
+    if (!c->hdr_len) {
+        size_t len = header_length(c->buf, c->len);
+        if (!len)
+            return false;
+
+        http_request_t req;
+        parse_request(c->buf, len, &req);
+        if (req.length > MAX_BODY) {
+            c->eof = true; /* Refuse to buffer it, drop the connection */
+            return false;
+        }
+        c->hdr_len = len;
+        c->body_len = req.length;
+        c->keep_alive = req.keep_alive;
+        c->script = req.script;
+        if (!c->script)
+            c->cmd = request_cmd(&req);
+    }
+
+    /* Wait for the whole body */
+    if (c->len < c->hdr_len + c->body_len)
+        return false;
+    if (c->script) {
+        c->cmd = malloc(c->body_len + 1);
+        if (!c->cmd) {
+            c->eof = true;
+            return false;
+        }
+        memcpy(c->cmd, c->buf + c->hdr_len, c->body_len);
+        c->cmd[c->body_len] = '\0';
+    }
+    c->used = c->hdr_len + c->body_len;
+    c->busy = true;
+
+    /* Stop watching the connection until its command has run */
+    mux_watch(c, 0);
+    list_del_init(&c->idle);
+    c->next = NULL;
+    *pending_tail = c;
+    pending_tail = &c->next;
+    return true;
+}
+
+/* Buffer space needed for the header, or for header and body once known */
+static size_t conn_limit(web_conn_t *c)
+{
+    return c->hdr_len ? c->hdr_len + c->body_len + 1 : MAX_REQUEST;
+}
+
+/* Read what is available until limit bytes are buffered.
+ * Return false if the buffer could not be grown.
+ */
+static bool conn_fill(web_conn_t *c, size_t limit)
+{
+    while (c->len + 1 < limit) {
+        if (c->cap - c->len < BUFSIZE && c->cap < limit) {
+            size_t cap = c->cap ? c->cap * 2 : BUFSIZE * 2;
+            if (cap > limit)
+                cap = limit;
+            char *tmp = realloc(c->buf, cap);
+            if (!tmp)
+                return false;
+            c->buf = tmp;
+            c->cap = cap;
+        }
+
+        /* Leave pipelined requests in the socket until there is room */
+        size_t room = (c->cap < limit ? c->cap : limit) - c->len - 1;
+        ssize_t n = read(c->fd, c->buf + c->len, room);
+        if (n > 0) {
+            c->len += n;
+            c->buf[c->len] = '\0';
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            c->eof = true;
+        break;
+    }
+    return true;
+}
+
+static void conn_read(web_conn_t *c)
+{
+    size_t limit;
+    conn_touch(c);
+    do {
+        limit = conn_limit(c);
+        if (!conn_fill(c, limit)) {
+            conn_close(c);
+            return;
+        }
+        if (conn_parse(c))
+            return;
+    } while (conn_limit(c) != limit); /* Header parsed, go on with body */
+
+    /* Close on EOF or oversized header unless a request can be served */
+    if (c->eof || c->len + 1 >= limit)
+        conn_close(c);
 }
 
 int web_open(int port)
@@ -153,78 +611,258 @@ int web_open(int port)
     /* Make it a listening socket ready to accept connection requests */
     if (listen(listenfd, LISTENQ) < 0)
         return -1;
+
+    /* Accept connections from the event loop without blocking */
+#if defined(__linux__)
+    mux_fd = epoll_create1(0);
+#else
+    mux_fd = kqueue();
+#endif
+    if (mux_fd < 0 || !set_nonblocking(listenfd))
+        return -1;
+
+    /* A client going away must not terminate the program */
+    signal(SIGPIPE, SIG_IGN);
+    listen_fd = listenfd;
+    if (!mux_add(listenfd))
+        return -1;
     return listenfd;
 }
 
-static void url_decode(char *src, char *dest, int max)
+int web_eventmux(void)
 {
-    char *p = src;
-    char code[3] = {0};
-    while (*p && --max) {
-        if (*p == '%') {
-            memcpy(code, ++p, 2);
-            *dest++ = (char) strtoul(code, NULL, 16);
-            p += 2;
-        } else {
-            *dest++ = *p++;
-        }
+    return mux_fd;
+}
+
+int web_timeout(void)
+{
+    if (list_empty(&idle_conns))
+        return -1;
+    web_conn_t *c = list_first_entry(&idle_conns, web_conn_t, idle);
+    long left = c->last + IDLE_TIMEOUT * 1000L - now_ms();
+    return left > 0 ? (int) left : 0;
+}
+
+/* Pick up where the connection stopped once its command is done: wait
+ * for the response to drain, then close or serve the next request.
+ */
+static void conn_resume(web_conn_t *c)
+{
+    conn_touch(c);
+    if (c->tx_off < c->tx_len) {
+        if (!mux_watch(c, MUX_OUT))
+            conn_close(c);
+        return;
     }
-    *dest = '\0';
+    if (c->closing) {
+        conn_close(c);
+        return;
+    }
+    if (conn_parse(c))
+        return; /* Responses are coalesced while the socket stays corked */
+
+    /* Push out everything corked before waiting for the client */
+    conn_push(c);
+    if (c->eof || !mux_watch(c, MUX_IN))
+        conn_close(c);
 }
 
-static void parse_request(int fd, http_request_t *req)
+/* The socket has room for more of a queued response */
+static void conn_drain(web_conn_t *c)
 {
-    rio_t rio;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE];
-    req->offset = 0;
-    req->end = 0; /* default */
+    size_t queued = c->tx_len - c->tx_off;
+    if (!conn_flush(c)) {
+        conn_close(c);
+        return;
+    }
+    /* A client which takes nothing for IDLE_TIMEOUT is dropped.  The
+     * client window may be smaller than a corked segment, so do not let
+     * what was written wait for more.
+     */
+    if (c->tx_len - c->tx_off < queued) {
+        conn_touch(c);
+        conn_push(c);
+    }
+    if (c->tx_off == c->tx_len)
+        conn_resume(c);
+}
 
-    rio_readinitb(&rio, fd);
-    rio_readlineb(&rio, buf, MAXLINE);
-    sscanf(buf, "%1023s %1023s", method, uri); /* version is not cared */
-    /* read all */
-    while (buf[0] != '\n' && buf[1] != '\n') { /* \n || \r\n */
-        rio_readlineb(&rio, buf, MAXLINE);
-        if (buf[0] == 'R' && buf[1] == 'a' && buf[2] == 'n') {
-            sscanf(buf, "Range: bytes=%lu-%lu", (unsigned long *) &req->offset,
-                   (unsigned long *) &req->end);
-            /* Range: [start, end] */
-            if (req->end != 0)
-                req->end++;
+void web_process(void)
+{
+    int fds[MAX_EVENTS];
+    int n = mux_wait(fds, MAX_EVENTS);
+    for (int i = 0; i < n; i++) {
+        if (fds[i] == listen_fd) {
+            conn_accept();
+            continue;
         }
+        web_conn_t *c = fds[i] < MAX_CONNS ? conns[fds[i]] : NULL;
+        if (!c || c->busy)
+            continue;
+        if (c->events & MUX_OUT)
+            conn_drain(c);
+        else
+            conn_read(c);
     }
-    char *filename = uri;
-    if (uri[0] == '/') {
-        filename = uri + 1;
-        int length = strlen(filename);
-        if (length == 0) {
-            filename = ".";
-        } else {
-            for (int i = 0; i < length; ++i) {
-                if (filename[i] == '?') {
-                    filename[i] = '\0';
-                    break;
-                }
-            }
+
+    /* Drop connections which stayed idle for too long */
+    long now = now_ms();
+    while (!list_empty(&idle_conns)) {
+        web_conn_t *c = list_first_entry(&idle_conns, web_conn_t, idle);
+        if (now - c->last < IDLE_TIMEOUT * 1000L)
+            break;
+        conn_close(c);
+    }
+}
+
+void *web_get_data(int connfd)
+{
+    web_conn_t *c = connfd >= 0 && connfd < MAX_CONNS ? conns[connfd] : NULL;
+    return c ? c->data : NULL;
+}
+
+void web_set_data(int connfd, void *data)
+{
+    web_conn_t *c = connfd >= 0 && connfd < MAX_CONNS ? conns[connfd] : NULL;
+    if (c)
+        c->data = data;
+}
+
+bool web_pending(void)
+{
+    return pending_head != NULL;
+}
+
+char *web_next_cmd(int *connfd)
+{
+    web_conn_t *c = pending_head;
+    if (!c)
+        return NULL;
+
+    pending_head = c->next;
+    if (!pending_head)
+        pending_tail = &pending_head;
+
+    char *cmd = c->cmd;
+    c->cmd = NULL;
+    if (!c->out)
+        c->out = malloc(OUT_BUFSIZE);
+    c->out_len = 0;
+    c->failed = !c->out; /* Without a buffer the request can only fail */
+    /* Results of a trace are streamed while it runs */
+    c->chunked = c->script;
+    c->started = false;
+    *connfd = c->fd;
+    return cmd;
+}
+
+/* Send the response header once, before any output */
+static bool conn_start(web_conn_t *c)
+{
+    if (c->started)
+        return true;
+    c->started = true;
+
+    char header[128];
+    int hlen;
+    if (c->chunked)
+        hlen = snprintf(header, sizeof(header),
+                        "HTTP/1.1 200 OK\r\n"
+                        "Content-Type: text/plain\r\n"
+                        "Transfer-Encoding: chunked\r\n%s\r\n",
+                        c->keep_alive ? "" : "Connection: close\r\n");
+    else
+        hlen = snprintf(header, sizeof(header),
+                        "HTTP/1.1 200 OK\r\n"
+                        "Content-Type: text/plain\r\n"
+                        "Content-Length: %zu\r\n%s\r\n", c->out_len,
+                        c->keep_alive ? "" : "Connection: close\r\n");
+    return conn_write(c, header, hlen);
+}
+
+/* Send collected output as one chunk */
+static bool conn_chunk(web_conn_t *c)
+{
+    char size[32];
+    int n = snprintf(size, sizeof(size), "%zx\r\n", c->out_len);
+    bool ok = conn_write(c, size, n) && conn_write(c, c->out, c->out_len) &&
+              conn_write(c, "\r\n", 2);
+    c->out_len = 0;
+    return ok;
+}
+
+/* Collect output of the running command.  Output which fits the buffer
+ * is sent with a Content-Length once the command completes.  Anything
+ * larger switches the response to chunked encoding and is sent whenever
+ * the buffer fills up, so memory stays bounded however long it gets.
+ */
+static void conn_output(web_conn_t *c, const char *buf, size_t len)
+{
+    while (len && !c->failed) {
+        if (c->out_len == OUT_BUFSIZE) {
+            if (!c->started)
+                c->chunked = true;
+            if (!conn_start(c) || !conn_chunk(c))
+                c->failed = true; /* Client is gone, drop the output */
+            continue;
         }
+        size_t n = OUT_BUFSIZE - c->out_len;
+        if (n > len)
+            n = len;
+        memcpy(c->out + c->out_len, buf, n);
+        c->out_len += n;
+        buf += n;
+        len -= n;
+    }
+}
+
+void web_send(int out_fd, char *buf)
+{
+    /* Output of a command run for a web request is part of its response */
+    web_conn_t *c = out_fd >= 0 && out_fd < MAX_CONNS ? conns[out_fd] : NULL;
+    if (c && c->busy) {
+        conn_output(c, buf, strlen(buf));
+        return;
     }
-    url_decode(filename, req->filename, MAXLINE);
+    writen(out_fd, buf, strlen(buf));
 }
 
-char *web_recv(int fd, struct sockaddr_in *clientaddr)
+void web_flush(int connfd)
 {
-    http_request_t req;
-    parse_request(fd, &req);
+    web_conn_t *c = connfd >= 0 && connfd < MAX_CONNS ? conns[connfd] : NULL;
+    if (!c || !c->chunked || !c->out_len || c->failed)
+        return;
+    if (!conn_start(c) || !conn_chunk(c)) {
+        /* Client is gone, drop the rest of the output */
+        c->failed = true;
+        return;
+    }
+    conn_push(c);
+}
 
-    char *p = req.filename;
-    /* Change '/' to ' ' */
-    while (*p) {
-        ++p;
-        if (*p == '/')
-            *p = ' ';
+void web_done(int connfd)
+{
+    if (connfd < 0 || connfd >= MAX_CONNS || !conns[connfd])
+        return;
+
+    web_conn_t *c = conns[connfd];
+    bool ok = !c->failed && conn_start(c);
+    if (c->chunked) {
+        ok = ok && (!c->out_len || conn_chunk(c)) &&
+             conn_write(c, "0\r\n\r\n", 5);
+    } else if (c->out_len) {
+        ok = ok && conn_write(c, c->out, c->out_len);
+    }
+    if (!ok) {
+        conn_close(c);
+        return;
     }
-    char *ret = malloc(strlen(req.filename) + 1);
-    strncpy(ret, req.filename, strlen(req.filename) + 1);
 
-    return ret;
+    /* Keep pipelined requests which arrived behind this one */
+    c->len -= c->used;
+    memmove(c->buf, c->buf + c->used, c->len + 1);
+    c->used = c->hdr_len = c->body_len = 0;
+    c->busy = false;
+    c->closing = !c->keep_alive;
+    conn_resume(c);
 }
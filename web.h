@@ -2,11 +2,40 @@
 #define TINYWEB_H
 
 #include <netinet/in.h>
+#include <stdbool.h>
 
 int web_open(int port);
 
-char *web_recv(int fd, struct sockaddr_in *clientaddr);
-
 void web_send(int out_fd, char *buffer);
 
+/* Descriptor which becomes readable when any connection needs attention */
+int web_eventmux(void);
+
+/* Milliseconds until the next idle connection times out, -1 if none */
+int web_timeout(void);
+
+/* Accept new connections and read available requests without blocking */
+void web_process(void);
+
+/* Return whether commands are waiting to be interpreted */
+bool web_pending(void);
+
+/* Pop the oldest waiting command, to be freed by the caller.
+ * The connection it came from is stored in connfd.
+ */
+char *web_next_cmd(int *connfd);
+
+/* Value kept by the interpreter for the connection, NULL initially */
+void *web_get_data(int connfd);
+void web_set_data(int connfd, void *data);
+
+/* Send output collected so far if the response is streamed */
+void web_flush(int connfd);
+
+/* Send the response with the output of the command run for connfd.
+ * The connection is kept open for further requests unless the client
+ * asked otherwise, and pipelined requests are queued right away.
+ */
+void web_done(int connfd);
+
 #endif